@@ -26,6 +26,7 @@
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <limits.h>
@@ -35,20 +36,51 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
-#include <sys/statfs.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <syscall.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#endif
+#endif
+// IORING_OP_OPENAT and IORING_OP_CLOSE arrived with opcode probing in Linux 5.6
+#if defined(IO_URING_OP_SUPPORTED) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+
+#if defined(__has_include)
+#if __has_include(<linux/btrfs.h>)
+#include <linux/btrfs.h>
+#endif
+#endif
+// Unprivileged subvolume info ioctl arrived in Linux 4.18
+#if defined(BTRFS_IOC_GET_SUBVOL_INFO)
+#define HAVE_BTRFS_SUBVOL_INFO 1
+#endif
+
 #include "inotify-info.h"
 #include "lfqueue/lfqueue.h"
 
@@ -58,6 +90,27 @@
 
 static int g_verbose = 0;
 static size_t g_numthreads = 32;
+static bool g_use_fhandles = true;
+static bool g_full_scan = false;
+static bool g_use_lfqueue = false;
+static size_t g_getdents_buffer_max = 1024 * 1024;
+static bool g_use_io_uring = false;
+// Seconds to wait for a directory on a network filesystem before giving up on
+// the mount. 0 scans network filesystems like local ones.
+static unsigned g_netfs_timeout = 5;
+// Descend into autofs mounts and automount points (mounting them)
+static bool g_include_automounts = false;
+// Descend into snapshot directories and btrfs snapshot subvolumes
+static bool g_include_snapshots = false;
+
+// Traversal policy: elevator (ascending inode order, limited threads) for rotational
+// devices with auto, for every device with elevator, or parallel FIFO for all with fifo.
+enum scan_policy_t {
+    POLICY_AUTO,
+    POLICY_FIFO,
+    POLICY_ELEVATOR,
+};
+static scan_policy_t g_policy = POLICY_AUTO;
 
 /* true if at least one inotify watch is found in fdinfo files
  * On a system with no active inotify watches, but which otherwise
@@ -72,6 +125,14 @@ static char thousands_sep = ',';
 
 static std::vector<std::string> ignore_dirs;
 
+// Filesystem type scan policy, from [fstypes] in the config file and --fstype
+enum fstype_policy_t {
+    FSTYPE_INCLUDE, // Scan like any other filesystem
+    FSTYPE_TARGETED, // Scan only if a watched inode lives on it
+    FSTYPE_EXCLUDE, // Never scan
+};
+static std::map<std::string, fstype_policy_t> fstype_policies;
+
 const char* RESET = "\x1b[0m";
 const char* YELLOW = "\x1b[0;33m";
 const char* CYAN = "\x1b[0;36m";
@@ -98,6 +159,37 @@ struct filename_info_t {
     ino64_t inode; // Inode number
     dev_t dev; // Device ID containing file
     std::string filename;
+    // Same file through other (bind) mounts
+    std::vector<std::string> alt_filenames;
+};
+
+/*
+ * inotify watch file handle info
+ */
+struct fhandle_info_t {
+    ino64_t inode; // Inode number
+    dev_t dev; // Device ID containing file
+    int handle_type; // fhandle-type
+    std::vector<unsigned char> handle; // f_handle bytes
+};
+
+/*
+ * /proc/self/mountinfo entry
+ */
+struct mount_info_t {
+    int mnt_id = 0;
+    int parent_id = 0;
+    // Device ID of the mounted filesystem
+    dev_t dev = 0;
+    // Root of the mount within the filesystem
+    std::string root;
+    // Mount point relative to our root
+    std::string mount_point;
+    // Filesystem type and source
+    std::string fstype;
+    std::string source;
+    // Superblock options (ie overlayfs lowerdir=...)
+    std::string super_options;
 };
 
 /*
@@ -127,719 +219,4213 @@ struct procinfo_t {
 
     // Device id map -> set of inodes for that device id
     std::unordered_map<dev_t, std::unordered_set<ino64_t>> dev_map;
+
+    // File handles for the watched inodes
+    std::vector<fhandle_info_t> fhandles;
 };
 
-class lfqueue_wrapper_t {
+/*
+ * mount table
+ */
+class mount_table_t {
 public:
-    lfqueue_wrapper_t() { lfqueue_init(&queue); }
-    ~lfqueue_wrapper_t() { lfqueue_destroy(&queue); }
+    ~mount_table_t();
+
+    bool load();
 
-    void queue_directory(char* path) { lfqueue_enq(&queue, path); }
-    char* dequeue_directory() { return (char*)lfqueue_deq(&queue); }
+    // Returns fd to use with open_by_handle_at() for this mount, -1 on error
+    int get_mount_fd(const mount_info_t& mount);
+
+    // Close fds opened by get_mount_fd()
+    void close_mount_fds();
 
 public:
-    typedef long long my_m256i __attribute__((__vector_size__(32), __aligned__(32)));
+    std::vector<mount_info_t> mounts;
 
-    union {
-        lfqueue_t queue;
-        my_m256i align_buf[4]; // Align to 128 bytes
-    };
+    // Map of mnt_id -> opened mount point fd
+    std::unordered_map<int, int> mount_fds;
 };
 
 /*
- * shared thread data
+ * mount being scanned
  */
-class thread_shared_data_t {
-public:
-    bool init(uint32_t numthreads, const std::vector<procinfo_t>& inotify_proclist);
+struct scan_mount_t {
+    // Device ID and mount ID from mountinfo
+    dev_t dev = 0;
+    int mnt_id = 0;
+    // procfs or FUSE mount
+    bool is_proc = false;
+    // Network filesystem: scanned on netfs_worker_t threads
+    bool is_netfs = false;
+    // btrfs: subvolume roots may be snapshots
+    bool is_btrfs = false;
+    // autofs or snapshot mount
+    bool is_excluded = false;
+    // File bind mount (ie /etc/hosts in containers): there's no directory to scan
+    bool is_file = false;
+    // Policy for this mount's filesystem type
+    fstype_policy_t policy = FSTYPE_INCLUDE;
+    // No watched devices on this mount (or is_proc, is_excluded): never descend into it
+    bool skip = false;
+    // Index of elevator queueing directories on this mount, -1 for the work-stealing deques
+    int elevator = -1;
+    // Index of worker group for this mount's device
+    int group = 0;
+};
 
-public:
-    // Array of queues - one per thread
-    std::vector<lfqueue_wrapper_t> dirqueues;
-    // Map of all inotify inodes watched to the set of devices they are on
-    std::unordered_map<ino64_t, std::unordered_set<dev_t>> inode_set;
+/*
+ * mount point path component trie
+ */
+struct mount_trie_t {
+    // Mount at this path, nullptr if this only leads to mount points further down
+    const scan_mount_t* mount = nullptr;
+    // Scan this directory last (overlayfs layer of a mount we're scanning)
+    bool excluded = false;
+    // Path component -> child node
+    std::unordered_map<std::string, std::unique_ptr<mount_trie_t>> children;
 };
 
 /*
- * thread info
+ * mount exposing a directory which is also visible through another mount (bind mounts)
  */
-class thread_info_t {
+struct mount_alias_t {
+    dev_t dev = 0;
+    // Alias mount point, and path to the same directory through the other mount (trailing slashes)
+    std::string path;
+    std::string target;
+};
+
+/*
+ * mount point index
+ */
+struct mount_index_t {
+    // Returns trie node for path, nullptr if no mount points are at or below path
+    const mount_trie_t* find_trie(const std::string& path) const;
+
+    // Visible mount point paths (with trailing slash) -> mount info
+    std::unordered_map<std::string, scan_mount_t> mount_points;
+    // Trie of mount_points path components, starting at "/"
+    mount_trie_t trie;
+    // All mount IDs in mountinfo
+    std::unordered_set<int> mnt_ids;
+    // Mounts showing directories we can get to through other mounts. Aliases of
+    // mounts being scanned are skipped.
+    std::vector<mount_alias_t> aliases;
+};
+
+// ignore_dirs compiled into a trie of path components. Patterns starting with '/'
+// match from the root, "*/dir/" and relative patterns match at any depth. Components
+// can be fnmatch() globs. Directories carry the trie nodes their path partly matches
+// so checking a child is one step per pattern prefix, not a compare per pattern.
+class ignore_matcher_t {
 public:
-    thread_info_t(thread_shared_data_t& tdata_in)
-        : tdata(tdata_in)
-    {
-    }
-    ~thread_info_t() { }
+    struct node_t {
+        bool ignore = false; // A pattern ends here
+        std::vector<std::pair<std::string, std::unique_ptr<node_t>>> names; // Sorted literal components
+        std::vector<std::pair<std::string, std::unique_ptr<node_t>>> globs;
+    };
+    // Nodes partly matching a directory path, sorted. Interned: compare by pointer.
+    typedef std::vector<const node_t*> state_t;
 
-    void queue_directory(char* path);
-    char* dequeue_directory();
+    void add(const std::string& pattern);
+    bool empty() const { return !has_patterns; }
 
-    // Returns -1: queue empty, 0: open error, > 0 success
-    int parse_dirqueue_entry();
+    // Returns state of subdirectory dname of a directory with state, nullptr if no
+    // pattern can match below it. Sets ignore if dname matches a pattern.
+    const state_t* next(const state_t* state, const char* dname, bool& ignore)
+    {
+        ignore = false;
+        if (!has_patterns)
+            return nullptr;
+        return next_slow(state, dname, ignore);
+    }
 
-    void add_filename(ino64_t inode, const char* path, const char* d_name, bool is_dir);
+    // Returns state of absolute path. Sets ignore if path or one of its parents matches.
+    const state_t* path_state(const std::string& path, bool& ignore);
 
-public:
-    uint32_t idx = 0;
-    pthread_t pthread_id = 0;
+private:
+    const state_t* next_slow(const state_t* state, const char* dname, bool& ignore);
 
-    thread_shared_data_t& tdata;
+    bool has_patterns = false;
+    node_t root;
+    node_t any_depth;
 
-    // Total dirs scanned by this thread
-    uint32_t scanned_dirs = 0;
-    // Files found by this thread
-    std::vector<filename_info_t> found_files;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    std::set<state_t> states;
 };
 
+static ignore_matcher_t ignore_matcher;
+
 /*
- * getdents64 syscall
+ * queued directory
  */
 GCC_DIAG_PUSH_OFF(pedantic)
-struct linux_dirent64 {
-    uint64_t d_ino; // Inode number
-    int64_t d_off; // Offset to next linux_dirent
-    unsigned short d_reclen; // Length of this linux_dirent
-    unsigned char d_type; // File type
-    char d_name[]; // Filename (null-terminated)
+struct dirqueue_entry_t {
+    dirqueue_entry_t* parent; // Parent directory (nullptr for scan roots)
+    uint32_t refcount; // 1 until scanned + 1 per queued child directory
+    int fd; // Open directory fd kept for openat() of children, -1 if none
+    ino64_t ino; // Inode number from parent dirent (0 if unknown)
+    dev_t dev; // Device ID of the mount this directory is on
+    int mnt_id; // Mount ID of the mount this directory is on
+    int elevator; // Elevator this directory is queued on, -1 if none
+    int group; // Worker group of the device this directory is on
+    bool is_netfs; // On a network filesystem
+    bool is_btrfs; // On btrfs
+    const mount_trie_t* mount_trie; // Mount points below this directory, nullptr if none
+    const ignore_matcher_t::state_t* ignore_state; // Partly matched ignore_dirs, nullptr if none
+    uint32_t namelen;
+    char name[]; // Directory name. Full path with trailing slash for scan roots.
 };
 GCC_DIAG_POP()
 
-int sys_getdents64(int fd, char* dirp, int count)
-{
-    return syscall(SYS_getdents64, fd, dirp, count);
-}
+/*
+ * Per-thread allocator for dirqueue entries and lfqueue nodes. Memory is carved out
+ * of large chunks which are only released when the scan is done. Freed entries go
+ * on the freeing thread's free lists (by size class) and get reused from there.
+ */
+class scan_arena_t {
+public:
+    scan_arena_t() { }
+    ~scan_arena_t()
+    {
+        for (char* chunk : chunks)
+            free(chunk);
+    }
+    scan_arena_t(const scan_arena_t&) = delete;
+    scan_arena_t& operator=(const scan_arena_t&) = delete;
 
-static double gettime()
-{
-    struct timespec ts;
+    // Allocate entry of size bytes. Returns nullptr if out of memory.
+    dirqueue_entry_t* alloc_entry(size_t size);
+    void free_entry(dirqueue_entry_t* entry);
 
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
-}
+    // lfqueue_init_mf() hooks. Nodes are never freed: the queue owner allocates
+    // them while other threads are dequeuing, so they're released with the arena.
+    static void* lfqueue_malloc(void* pl, size_t size) { return ((scan_arena_t*)pl)->alloc(size); }
+    static void lfqueue_free(void*, void*) { }
 
-std::string string_formatv(const char* fmt, va_list ap)
+private:
+    void* alloc(size_t size);
+
+    static size_t size_class(size_t size) { return (size + CLASS_SIZE - 1) / CLASS_SIZE; }
+
+public:
+    static const size_t CHUNK_SIZE = 256 * 1024;
+    static const size_t CLASS_SIZE = 32;
+    static const size_t NUM_CLASSES = (sizeof(dirqueue_entry_t) + PATH_MAX + CLASS_SIZE) / CLASS_SIZE + 1;
+
+    // Allocations made, and how many came from free lists
+    uint64_t allocs = 0;
+    uint64_t reused = 0;
+    // Bytes of chunks allocated
+    size_t chunk_bytes = 0;
+
+private:
+    std::vector<char*> chunks;
+    char* cur = nullptr;
+    size_t avail = 0;
+    // Free entries by size class. The next pointer is stored in the entry itself.
+    void* free_lists[NUM_CLASSES] = {};
+};
+
+void* scan_arena_t::alloc(size_t size)
 {
-    std::string str;
-    int size = 512;
+    size = (size + 15) & ~(size_t)15;
 
-    for (;;) {
-        str.resize(size);
-        int n = vsnprintf((char*)str.c_str(), size, fmt, ap);
+    if (size > avail) {
+        char* chunk = (char*)malloc(CHUNK_SIZE);
 
-        if ((n > -1) && (n < size)) {
-            str.resize(n);
-            return str;
-        }
+        if (!chunk)
+            return nullptr;
 
-        size = (n > -1) ? (n + 1) : (size * 2);
+        chunks.push_back(chunk);
+        chunk_bytes += CHUNK_SIZE;
+        cur = chunk;
+        avail = CHUNK_SIZE;
     }
+
+    void* ptr = cur;
+    cur += size;
+    avail -= size;
+    allocs++;
+    return ptr;
 }
 
-std::string string_format(const char* fmt, ...)
+dirqueue_entry_t* scan_arena_t::alloc_entry(size_t size)
 {
-    va_list ap;
-    std::string str;
+    size_t sc = size_class(size);
 
-    va_start(ap, fmt);
-    str = string_formatv(fmt, ap);
-    va_end(ap);
+    if (sc >= NUM_CLASSES)
+        return nullptr;
 
-    return str;
+    void* ptr = free_lists[sc];
+
+    if (ptr) {
+        free_lists[sc] = *(void**)ptr;
+        allocs++;
+        reused++;
+        return (dirqueue_entry_t*)ptr;
+    }
+
+    return (dirqueue_entry_t*)alloc(sc * CLASS_SIZE);
 }
 
-static std::string get_link_name(const char* pathname)
+void scan_arena_t::free_entry(dirqueue_entry_t* entry)
 {
-    std::string Result;
-    char filename[PATH_MAX + 1];
+    size_t sc = size_class(sizeof(dirqueue_entry_t) + entry->namelen + 1);
 
-    ssize_t ret = readlink(pathname, filename, sizeof(filename));
-    if ((ret > 0) && (ret < (ssize_t)sizeof(filename))) {
-        filename[ret] = 0;
-        Result = filename;
-    }
-    return Result;
+    *(void**)entry = free_lists[sc];
+    free_lists[sc] = entry;
 }
 
-static uid_t get_uid(const char* pathname)
-{
-    int fd = open(pathname, O_RDONLY, 0);
+class lfqueue_wrapper_t {
+public:
+    lfqueue_wrapper_t() { memset(&queue, 0, sizeof(queue)); }
+    ~lfqueue_wrapper_t()
+    {
+        if (queue.head)
+            lfqueue_destroy(&queue);
+    }
 
-    if (fd >= 0) {
-        char buf[16 * 1024];
+    // Queue nodes are allocated from arena, which needs to outlive us
+    void init(scan_arena_t* arena) { lfqueue_init_mf(&queue, arena, scan_arena_t::lfqueue_malloc, scan_arena_t::lfqueue_free); }
 
-        ssize_t len = read(fd, buf, sizeof(buf));
+    void queue_directory(dirqueue_entry_t* entry) { lfqueue_enq(&queue, entry); }
+    dirqueue_entry_t* dequeue_directory() { return (dirqueue_entry_t*)lfqueue_deq(&queue); }
 
-        close(fd);
-        fd = -1;
+public:
+    typedef long long my_m256i __attribute__((__vector_size__(32), __aligned__(32)));
 
-        if (len > 0) {
-            buf[len - 1] = 0;
+    union {
+        lfqueue_t queue;
+        my_m256i align_buf[4]; // Align to 128 bytes
+    };
+};
 
-            const char* uidstr = strstr(buf, "\nUid:");
-            if (uidstr) {
-                return atoll(uidstr + 5);
-            }
+/*
+ * Chase-Lev work-stealing deque of queued directories. The owning thread
+ * pushes and pops at the bottom (LIFO), other threads steal from the top (FIFO).
+ * Memory ordering follows "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" (Le, Pop, Cohen, Zappa Nardelli, 2013).
+ */
+class ws_deque_t {
+public:
+    ws_deque_t() { grow(nullptr, 0, 0); }
+
+    // Owner only
+    void push(dirqueue_entry_t* entry);
+    dirqueue_entry_t* pop();
+
+    // Any thread. Returns nullptr once the deque is empty.
+    dirqueue_entry_t* steal();
+
+private:
+    struct array_t {
+        array_t(size_t size_in)
+            : mask(size_in - 1)
+            , buf(new std::atomic<dirqueue_entry_t*>[size_in])
+        {
         }
-    }
 
-    return -1;
-}
+        dirqueue_entry_t* get(int64_t i) const { return buf[i & mask].load(std::memory_order_relaxed); }
+        void put(int64_t i, dirqueue_entry_t* entry) { buf[i & mask].store(entry, std::memory_order_relaxed); }
 
-static uint64_t get_token_val(const char* line, const char* token)
+        size_t mask;
+        std::unique_ptr<std::atomic<dirqueue_entry_t*>[]> buf;
+    };
+
+    // Replace array with one twice the size. Old arrays are kept since thieves could be reading them.
+    array_t* grow(array_t* a, int64_t b, int64_t t);
+
+private:
+    std::atomic<int64_t> top { 0 };
+    char pad0[64 - sizeof(std::atomic<int64_t>)];
+    std::atomic<int64_t> bottom { 0 };
+    std::atomic<array_t*> array { nullptr };
+    char pad1[64 - sizeof(std::atomic<int64_t>) - sizeof(std::atomic<array_t*>)];
+    // Owner only
+    std::vector<std::unique_ptr<array_t>> arrays;
+};
+
+ws_deque_t::array_t* ws_deque_t::grow(array_t* a, int64_t b, int64_t t)
 {
-    const char* str = strstr(line, token);
+    array_t* new_a = new array_t(a ? 2 * (a->mask + 1) : 256);
 
-    return str ? strtoull(str + strlen(token), nullptr, 16) : 0;
+    for (int64_t i = t; i < b; i++)
+        new_a->put(i, a->get(i));
+
+    arrays.emplace_back(new_a);
+    array.store(new_a, std::memory_order_release);
+    return new_a;
 }
 
-static uint32_t inotify_parse_fdinfo_file(procinfo_t& procinfo, const char* fdset_name)
+void ws_deque_t::push(dirqueue_entry_t* entry)
 {
-    uint32_t watch_count = 0;
-
-    FILE* fp = fopen(fdset_name, "r");
-    if (fp) {
-        char line_buf[256];
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    array_t* a = array.load(std::memory_order_relaxed);
 
-        procinfo.fdset_filenames.push_back(fdset_name);
+    if (b - t > (int64_t)a->mask)
+        a = grow(a, b, t);
 
-        for (;;) {
-            if (!fgets(line_buf, sizeof(line_buf), fp))
-                break;
+    a->put(b, entry);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+}
 
-            /* sample fdinfo; inotify line added in linux 3.8, available if
-             * kernel compiled with CONFIG_INOTIFY_USER and CONFIG_PROC_FS
-             *   pos:    0
-             *   flags:  00
-             *   mnt_id: 15
-             *   ino:    5865
-             *   inotify wd:1 ino:80001 sdev:800011 mask:100 ignored_mask:0 fhandle-bytes:8 fhandle-type:1 f_handle:01000800bc1b8c7c
-             */
-            if (!strncmp(line_buf, "inotify ", 8)) {
-                watch_count++;
+dirqueue_entry_t* ws_deque_t::pop()
+{
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    array_t* a = array.load(std::memory_order_relaxed);
 
-                uint64_t inode_val = get_token_val(line_buf, "ino:");
-                uint64_t sdev_val = get_token_val(line_buf, "sdev:");
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
 
-                if (inode_val) {
-                    // https://unix.stackexchange.com/questions/645937/listing-the-files-that-are-being-watched-by-inotify-instances
-                    //   Assuming that the sdev field is encoded according to Linux's so-called "huge
-                    //   encoding", which uses 20 bits (instead of 8) for minor numbers, in bitwise
-                    //   parlance the major number is sdev >> 20 while the minor is sdev & 0xfffff.
-                    unsigned int major = sdev_val >> 20;
-                    unsigned int minor = sdev_val & 0xfffff;
+    if (t > b) {
+        // Empty
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
 
-                    // Add inode to this device map
-                    procinfo.dev_map[makedev(major, minor)].insert(inode_val);
-                }
-            }
-        }
+    dirqueue_entry_t* entry = a->get(b);
 
-        fclose(fp);
+    if (t == b) {
+        // Last entry: race thieves for it
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            entry = nullptr;
+        bottom.store(b + 1, std::memory_order_relaxed);
     }
 
-    return watch_count;
+    return entry;
 }
 
-static void inotify_parse_fddir(procinfo_t& procinfo)
+dirqueue_entry_t* ws_deque_t::steal()
 {
-    std::string filename = string_format("/proc/%d/fd", procinfo.pid);
-
-    DIR* dir_fd = opendir(filename.c_str());
-    if (!dir_fd)
-        return;
-
     for (;;) {
-        struct dirent* dp_fd = readdir(dir_fd);
-        if (!dp_fd)
-            break;
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
 
-        if ((dp_fd->d_type == DT_LNK) && isdigit(dp_fd->d_name[0])) {
-            filename = string_format("/proc/%d/fd/%s", procinfo.pid, dp_fd->d_name);
-            filename = get_link_name(filename.c_str());
+        if (t >= b)
+            return nullptr;
 
-            if (filename == "anon_inode:inotify" || filename == "inotify") {
-                filename = string_format("/proc/%d/fdinfo/%s", procinfo.pid, dp_fd->d_name);
+        array_t* a = array.load(std::memory_order_acquire);
+        dirqueue_entry_t* entry = a->get(t);
 
-                procinfo.instances++;
-                procinfo.watches += inotify_parse_fdinfo_file(procinfo, filename.c_str());
+        if (top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return entry;
 
-                /* If any watches have been found, enable the stats display */
-                g_kernel_provides_watches_info |= !!procinfo.watches;
-            }
-        }
+        // Lost the race to another thief or the owner: try again
     }
-
-    closedir(dir_fd);
 }
 
-void thread_info_t::queue_directory(char* path)
-{
-    tdata.dirqueues[idx].queue_directory(path);
-}
+/*
+ * Open addressing hash table of watched (device, inode) pairs. Built once
+ * before the scan threads start, then probed read-only (lock free) by all of them.
+ */
+class inode_table_t {
+public:
+    static const size_t NOT_FOUND = (size_t)-1;
 
-char* thread_info_t::dequeue_directory()
-{
-    char* path = tdata.dirqueues[idx].dequeue_directory();
+    struct slot_t {
+        ino64_t inode; // 0 if slot is empty
+        dev_t dev;
+    };
 
-    if (!path) {
-        // Nothing on our queue, check queues on other threads
-        for (lfqueue_wrapper_t& dirq : tdata.dirqueues) {
-            path = dirq.dequeue_directory();
-            if (path)
-                break;
-        }
-    }
+    // Insert (dev, inode). Only call before the table is shared with other threads.
+    void insert(dev_t dev, ino64_t inode);
 
-    return path;
-}
+    // Returns slot index of (dev, inode), or NOT_FOUND
+    size_t find(dev_t dev, ino64_t inode) const
+    {
+        for (size_t i = hash(dev, inode);; i = (i + 1) & mask) {
+            const slot_t& slot = slots[i];
 
-// statx() was added to Linux in kernel 4.11; library support was added in glibc 2.28.
-#if defined(__linux__) && ((__GLIBC__ >= 2 && __GLIBC_MINOR__ >= 28) || (__GLIBC__ > 2))
+            if (slot.inode == inode && slot.dev == dev)
+                return i;
+            if (!slot.inode)
+                return NOT_FOUND;
+        }
+    }
 
-struct statx mystatx(const char* filename, unsigned int mask = 0)
-{
-    struct statx statxbuf;
-    int flags = AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC;
+    // Count of (dev, inode) pairs in table
+    size_t size() const { return count; }
+    // Number of slots. Slot indexes are < capacity().
+    size_t capacity() const { return slots.size(); }
+    const slot_t& slot(size_t i) const { return slots[i]; }
 
-    if (statx(0, filename, flags, mask, &statxbuf) == -1) {
-        printf("ERROR: statx-ino( %s ) failed. Errno: %d (%s)\n", filename, errno, strerror(errno));
-        memset(&statxbuf, 0, sizeof(statxbuf));
+private:
+    size_t hash(dev_t dev, ino64_t inode) const
+    {
+        // Fibonacci hashing: top bits of the product are well mixed
+        return ((inode ^ ((uint64_t)dev << 29)) * 0x9e3779b97f4a7c15ULL) >> shift;
     }
 
-    return statxbuf;
-}
+    void grow();
 
-static dev_t stat_get_dev_t(const char* filename)
+private:
+    std::vector<slot_t> slots;
+    size_t count = 0;
+    size_t mask = 0;
+    int shift = 64;
+};
+
+void inode_table_t::grow()
 {
-    struct statx statxbuf = mystatx(filename);
+    std::vector<slot_t> old_slots(std::max<size_t>(16, slots.size() * 2));
 
-    return makedev(statxbuf.stx_dev_major, statxbuf.stx_dev_minor);
-}
+    // Keep load factor under 1/2 so misses (most dirents) end after a probe or two
+    old_slots.swap(slots);
+    mask = slots.size() - 1;
+    shift = 64 - __builtin_ctzll(slots.size());
+    count = 0;
 
-static uint64_t stat_get_ino(const char* filename)
-{
-    return mystatx(filename, STATX_INO).stx_ino;
+    for (const slot_t& slot : old_slots) {
+        if (slot.inode)
+            insert(slot.dev, slot.inode);
+    }
 }
 
-#else
+void inode_table_t::insert(dev_t dev, ino64_t inode)
+{
+    // Inode 0 marks empty slots. It isn't a valid inode number.
+    if (!inode)
+        return;
 
-// Fall back to using stat() functions. Should work but be slower than using statx().
+    if (2 * (count + 1) > slots.size())
+        grow();
 
-static dev_t stat_get_dev_t(const char* filename)
-{
-    struct stat statbuf;
+    size_t i = hash(dev, inode);
 
-    int ret = stat(filename, &statbuf);
-    if (ret == -1) {
-        printf("ERROR: stat-dev_t( %s ) failed. Errno: %d (%s)\n", filename, errno, strerror(errno));
-        return 0;
+    for (; slots[i].inode; i = (i + 1) & mask) {
+        if (slots[i].inode == inode && slots[i].dev == dev)
+            return;
     }
-    return statbuf.st_dev;
+
+    slots[i].inode = inode;
+    slots[i].dev = dev;
+    count++;
 }
 
-static uint64_t stat_get_ino(const char* filename)
-{
-    struct stat statbuf;
+/*
+ * Bitset of hashed watched inode numbers. Checked against every inode in a
+ * getdents64 buffer at once so only possible matches get an inode_table lookup.
+ */
+class inode_filter_t {
+public:
+    // Fold inode to the 32-bit key filter() takes
+    static uint32_t key(ino64_t inode) { return (uint32_t)(inode ^ (inode >> 32)); }
 
-    int ret = stat(filename, &statbuf);
-    if (ret == -1) {
-        printf("ERROR: stat-ino( %s ) failed. Errno: %d (%s)\n", filename, errno, strerror(errno));
-        return 0;
-    }
+    void build(const inode_table_t& table);
 
-    return statbuf.st_ino;
-}
+    // Set bit i in maybe (count bits, rounded up to bytes) if keys[i] might be watched.
+    // keys must be padded with readable entries to a multiple of 8.
+    void filter(const uint32_t* keys, size_t count, uint8_t* maybe) const { filter_fn(this, keys, count, maybe); }
+
+private:
+    uint32_t bit_index(uint32_t k) const { return (k * 0x9e3779b1U) >> shift; }
 
+    static void filter_scalar(const inode_filter_t* self, const uint32_t* keys, size_t count, uint8_t* maybe);
+#if HAVE_X86_SIMD
+    static void filter_avx2(const inode_filter_t* self, const uint32_t* keys, size_t count, uint8_t* maybe);
 #endif
 
-void thread_info_t::add_filename(ino64_t inode, const char* path, const char* d_name, bool is_dir)
-{
-    auto it = tdata.inode_set.find(inode);
+private:
+    std::vector<uint32_t> words;
+    uint32_t shift = 32;
+    void (*filter_fn)(const inode_filter_t*, const uint32_t*, size_t, uint8_t*) = filter_scalar;
+};
 
-    if (it != tdata.inode_set.end()) {
-        const std::unordered_set<dev_t>& dev_set = it->second;
+void inode_filter_t::build(const inode_table_t& table)
+{
+    // ~16 bits per inode keeps false positives around 6%. 2^10 to 2^27 bits.
+    int bits_log2 = 10;
 
-        std::string filename = std::string(path) + d_name;
-        dev_t dev = stat_get_dev_t(filename.c_str());
+    while ((bits_log2 < 27) && ((1ULL << bits_log2) < 16 * table.size()))
+        bits_log2++;
 
-        // Make sure the inode AND device ID match before adding.
-        if (dev_set.find(dev) != dev_set.end()) {
-            filename_info_t fname;
+    words.assign((1U << bits_log2) / 32, 0);
+    shift = 32 - bits_log2;
 
-            fname.filename = is_dir ? filename + "/" : filename;
-            fname.inode = inode;
-            fname.dev = dev;
+    for (size_t i = 0; i < table.capacity(); i++) {
+        if (table.slot(i).inode) {
+            uint32_t bit = bit_index(key(table.slot(i).inode));
 
-            found_files.push_back(fname);
+            words[bit / 32] |= 1U << (bit % 32);
         }
     }
-}
 
-static bool is_dot_dir(const char* dname)
-{
-    if (dname[0] == '.') {
-        if (!dname[1])
+#if HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx2"))
+        filter_fn = filter_avx2;
+#endif
+    if (g_verbose > 1) {
+        printf("Inode prefilter: %zu bytes, %s\n", words.size() * sizeof(uint32_t),
+            (filter_fn == filter_scalar) ? "scalar" : "avx2");
+    }
+}
+
+void inode_filter_t::filter_scalar(const inode_filter_t* self, const uint32_t* keys, size_t count, uint8_t* maybe)
+{
+    for (size_t i = 0; i < count; i += 8) {
+        uint8_t mask = 0;
+
+        for (size_t j = 0; j < 8; j++) {
+            uint32_t bit = self->bit_index(keys[i + j]);
+
+            mask |= ((self->words[bit / 32] >> (bit % 32)) & 1) << j;
+        }
+        maybe[i / 8] = mask;
+    }
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("avx2"))) void inode_filter_t::filter_avx2(const inode_filter_t* self, const uint32_t* keys, size_t count, uint8_t* maybe)
+{
+    const __m256i mul = _mm256_set1_epi32(0x9e3779b1U);
+    const __m128i shift = _mm_cvtsi32_si128(self->shift);
+    const __m256i low5 = _mm256_set1_epi32(31);
+    const __m256i one = _mm256_set1_epi32(1);
+    const int* words = (const int*)self->words.data();
+
+    for (size_t i = 0; i < count; i += 8) {
+        __m256i k = _mm256_loadu_si256((const __m256i*)(keys + i));
+        __m256i bit = _mm256_srl_epi32(_mm256_mullo_epi32(k, mul), shift);
+        __m256i word = _mm256_i32gather_epi32(words, _mm256_srli_epi32(bit, 5), 4);
+        __m256i set = _mm256_and_si256(word, _mm256_sllv_epi32(one, _mm256_and_si256(bit, low5)));
+        __m256i unset = _mm256_cmpeq_epi32(set, _mm256_setzero_si256());
+
+        maybe[i / 8] = ~_mm256_movemask_ps(_mm256_castsi256_ps(unset));
+    }
+}
+#endif
+
+/*
+ * Queue for directories on a rotational device. Directories are handed out
+ * in ascending inode order (approximately on-disk order on ext4 and XFS),
+ * wrapping around at the end (C-SCAN), to at most MAX_ACTIVE threads at a time.
+ */
+struct elevator_t {
+    // Directories being scanned at once. 2 lets one thread parse while the other waits on the disk.
+    static const uint32_t MAX_ACTIVE = 2;
+
+    dev_t dev = 0;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    // Queued directories by inode
+    std::set<std::pair<ino64_t, dirqueue_entry_t*>> pending;
+    // Size of pending, readable without the lock
+    std::atomic<uint32_t> pending_count { 0 };
+    // Threads scanning directories from this elevator
+    uint32_t active = 0;
+    // Last inode handed out
+    ino64_t head = 0;
+
+    // Take the next directory in sweep order. Call with lock held and pending not empty.
+    dirqueue_entry_t* pop_next();
+};
+
+/*
+ * Threads which prefer directories on one block device. Non-block devices
+ * (tmpfs, nfs, btrfs, ...) share a group. Threads only help other groups
+ * once their own group has run out of work.
+ */
+struct worker_group_t {
+    // Block device, or 0 for the group of non-block devices
+    dev_t dev = 0;
+    // Directories on dev are handed out by an elevator (see g_policy)
+    bool use_elevator = false;
+    // Threads in this group. Fixed once the scan starts.
+    std::vector<uint32_t> members;
+    // Directories queued by threads outside this group
+    pthread_mutex_t inbox_lock = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<dirqueue_entry_t*> inbox;
+    std::atomic<uint32_t> inbox_count { 0 };
+};
+
+/*
+ * shared thread data
+ */
+class thread_shared_data_t {
+public:
+    bool init(uint32_t numthreads, const std::vector<procinfo_t>& inotify_proclist);
+
+    // Pick mounts to scan based on the devices still being searched for
+    void init_scan_roots();
+
+    // Add mounts being scanned which aren't reached from a parent mount to scan_roots
+    void find_scan_roots(const mount_index_t* index, std::map<std::string, bool>& targeted);
+
+    // Mark inode_table slot as found. Returns false if it already was.
+    bool set_inode_found(size_t index);
+
+    // Build mount point index from mounts
+    const mount_index_t* build_mount_index();
+
+    // Returns elevator index for mounts on dev (creating it if needed) or -1 if
+    // g_policy says to use the work-stealing deques. Call with mount_index_lock held.
+    int get_elevator(dev_t dev);
+
+    // Returns worker group index for dev, creating it if needed. Call with mount_index_lock held.
+    int get_group(dev_t dev);
+
+    // Split threads between worker groups. Returns group index for each thread.
+    std::vector<int> assign_worker_groups(uint32_t numthreads);
+
+    // Push directory to another group's inbox
+    void push_inbox(dirqueue_entry_t* entry);
+    // Pop directory from group's inbox, nullptr if empty
+    dirqueue_entry_t* pop_inbox(int index);
+
+    // Reload mountinfo if mnt_id isn't in the current mount index. Returns current index.
+    const mount_index_t* refresh_mount_index(int mnt_id);
+
+    const mount_index_t* get_mount_index() const { return mount_index.load(std::memory_order_acquire); }
+
+    // Set up fds_available from RLIMIT_NOFILE
+    void init_fd_cache();
+
+    // Try to reserve an fd to keep open for openat() of children
+    bool reserve_cached_fd();
+
+    // Drop reference to a queued directory, freeing it (and parents) to arena when unused
+    void release_dirqueue_entry(dirqueue_entry_t* entry, scan_arena_t& arena);
+
+    // Done scanning a dequeued directory: release it and count it off work_outstanding
+    void finish_dirqueue_entry(dirqueue_entry_t* entry, scan_arena_t& arena);
+
+    // Done with a directory from elevator index. Returns the next directory from that
+    // elevator (keeping the slot) if take_next is set, otherwise frees up the slot.
+    dirqueue_entry_t* elevator_next(int index, bool take_next = true);
+
+    // Wake threads parked in wait_for_directory()
+    void wake_threads(bool all);
+
+    // Hold on to directory until everything else has been scanned
+    void defer_directory(dirqueue_entry_t* entry);
+
+    // Record network filesystem directory path timing out: skip the rest of mount mnt_id
+    void set_netfs_timed_out(int mnt_id, const std::string& path);
+
+    // Returns true if a directory on mount mnt_id has timed out
+    bool is_netfs_stale(int mnt_id);
+
+    // Returns true if all inodes have been found and threads should stop scanning
+    bool all_inodes_found() const { return !g_full_scan && !inodes_remaining.load(std::memory_order_relaxed); }
+
+public:
+    // Array of allocators - one per thread. Declared before the queues so it outlives them.
+    std::unique_ptr<scan_arena_t[]> arenas;
+    // Array of queues - one per thread (--queue=lfqueue)
+    std::vector<lfqueue_wrapper_t> dirqueues;
+    // Array of work-stealing deques - one per thread
+    std::unique_ptr<ws_deque_t[]> ws_deques;
+    uint32_t numqueues = 0;
+    // All (device, inode) pairs watched
+    inode_table_t inode_table;
+    // Prefilter for inode_table lookups
+    inode_filter_t inode_filter;
+    // Set once each (device, inode) pair has been found. Indexed by inode_table slot.
+    std::unique_ptr<std::atomic<bool>[]> inode_found;
+    // Set for inodes resolved by file handle: the directory scan doesn't report them again
+    std::unique_ptr<bool[]> inode_resolved;
+    // Count of (inode, device) pairs not found yet
+    std::atomic<uint32_t> inodes_remaining { 0 };
+    // File handles for the watched inodes
+    std::vector<fhandle_info_t> fhandles;
+    // Mount table used to open file handles and pick scan roots
+    mount_table_t mounts;
+    // Mount points to start scanning from
+    std::vector<std::string> scan_roots;
+    // Non-directory mount points being scanned: checked directly
+    std::vector<std::string> scan_files;
+    // Devices with inodes still being searched for
+    std::unordered_set<dev_t> target_devs;
+    // No mount holds a target device: scan all mounts
+    bool scan_all_mounts = false;
+    // Current mount point index
+    std::atomic<const mount_index_t*> mount_index { nullptr };
+    // All mount indexes built. Threads can still be using old ones until the scan finishes.
+    std::vector<std::unique_ptr<mount_index_t>> mount_indexes;
+    pthread_mutex_t mount_index_lock = PTHREAD_MUTEX_INITIALIZER;
+    // Count of directory fds we can still keep open
+    std::atomic<int> fds_available { 0 };
+    // Directories each io_uring thread opens per submission
+    unsigned io_uring_batch = 1;
+    // Elevators for rotational devices. Entries are never moved once published in num_elevators.
+    static const int MAX_ELEVATORS = 64;
+    std::unique_ptr<elevator_t> elevators[MAX_ELEVATORS];
+    std::atomic<int> num_elevators { 0 };
+    // Device -> elevator index (or -1). Protected by mount_index_lock.
+    std::unordered_map<dev_t, int> elevator_devs;
+    // Worker groups, published like elevators. Group 0 is for non-block devices.
+    static const int MAX_GROUPS = 64;
+    std::unique_ptr<worker_group_t> groups[MAX_GROUPS];
+    std::atomic<int> num_groups { 0 };
+
+    // Network filesystem directories which timed out, and their mounts
+    pthread_mutex_t netfs_lock = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<std::string> netfs_timeouts;
+    std::unordered_set<int> netfs_stale_mounts;
+    std::atomic<uint32_t> netfs_num_stale { 0 };
+    // Directories skipped because their mount timed out
+    std::atomic<uint32_t> netfs_skipped { 0 };
+    // Directories queued or being scanned. The scan is done when this hits zero.
+    std::atomic<uint64_t> work_outstanding { 0 };
+    // Threads parked waiting for work
+    std::atomic<uint32_t> idle_threads { 0 };
+    // Directories to queue once work_outstanding drops to 0. Protected by work_lock.
+    std::vector<dirqueue_entry_t*> deferred_dirs;
+    pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+};
+
+/*
+ * search stats
+ */
+struct search_stats_t {
+    // Count of (inode, device) pairs searched for
+    uint32_t total_inodes = 0;
+    // Inodes resolved with open_by_handle_at()
+    uint32_t fhandle_inodes = 0;
+    // Total dirs scanned by all threads
+    uint32_t scanned_dirs = 0;
+    // getdents64 calls made, and estimate of calls with a 1 KiB buffer
+    uint64_t getdents_calls = 0;
+    uint64_t getdents_calls_1k = 0;
+    // Queue allocations served by scan arenas instead of malloc, and arena memory used
+    uint64_t arena_allocs = 0;
+    uint64_t arena_reused = 0;
+    size_t arena_bytes = 0;
+};
+
+/*
+ * Page aligned getdents64 buffer, reused for every directory a thread scans
+ */
+class getdents_buffer_t {
+public:
+    // Initial buffer size. Grows up to g_getdents_buffer_max for large directories.
+    static const size_t INITIAL_SIZE = 32 * 1024;
+
+    getdents_buffer_t() { }
+    // Copies start out empty: buffers are allocated by the thread that uses them
+    getdents_buffer_t(const getdents_buffer_t&) { }
+    getdents_buffer_t& operator=(const getdents_buffer_t&) = delete;
+    ~getdents_buffer_t() { free(buf); }
+
+    // Grow buffer to at least size bytes (capped at g_getdents_buffer_max).
+    // Returns false if we have no buffer at all.
+    bool reserve(size_t size);
+
+public:
+    char* buf = nullptr;
+    size_t size = 0;
+
+    // Prefilter keys and results for the dirents in buf
+    std::vector<uint32_t> keys;
+    std::vector<uint8_t> maybe;
+};
+
+#if HAVE_IO_URING
+/*
+ * Minimal io_uring wrapper using raw syscalls (no liburing dependency)
+ */
+class io_uring_t {
+public:
+    // Directories opened per submission
+    static const unsigned BATCH = 32;
+    // user_data for close requests. Opens use their batch index.
+    static const uint64_t CLOSE_TAG = ~0ULL;
+
+    io_uring_t() { }
+    // Copies start out without a ring: rings are set up by the thread that uses them
+    io_uring_t(const io_uring_t&) { }
+    io_uring_t& operator=(const io_uring_t&) = delete;
+    ~io_uring_t();
+
+    // Returns true if the kernel lets us use io_uring openat and close
+    static bool supported();
+
+    // Set up ring with room for a batch of opens plus closes
+    bool init();
+    bool is_open() const { return ring_fd >= 0; }
+
+    // Queue openat / close. Caller makes sure there's room (BATCH of each).
+    void prep_openat(int dirfd, const char* path, int flags, uint64_t user_data);
+    void prep_close(int fd);
+
+    // Submit queued requests and wait for at least wait_nr completions
+    bool submit_and_wait(unsigned wait_nr);
+
+    // Give up on a ring that failed: tear it down and add the fds of queued closes
+    // the kernel never saw to unsubmitted_closes.
+    void abandon(std::vector<int>& unsubmitted_closes);
+
+    // Returns next completion or nullptr. Call cqe_seen() when done with it.
+    struct io_uring_cqe* peek_cqe();
+    void cqe_seen() { __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE); }
+
+public:
+    // Closes queued but not yet completed
+    unsigned pending_closes = 0;
+
+private:
+    struct io_uring_sqe* get_sqe();
+    void release();
+
+private:
+    int ring_fd = -1;
+    void* ring_ptr = MAP_FAILED;
+    size_t ring_size = 0;
+    struct io_uring_sqe* sqes = (struct io_uring_sqe*)MAP_FAILED;
+    size_t sqes_size = 0;
+
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    // SQEs [sqe_head, sqe_tail) are prepared but not published in sq_tail yet. Published
+    // SQEs stay in the ring until the kernel consumes them (moves sq_head past them).
+    unsigned sqe_head = 0;
+    unsigned sqe_tail = 0;
+
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    struct io_uring_cqe* cqes = nullptr;
+};
+
+bool io_uring_t::supported()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    // Fails with ENOSYS on old kernels, EPERM if disabled by sysctl or seccomp
+    int fd = syscall(__NR_io_uring_setup, 1, &params);
+    if (fd < 0)
+        return false;
+
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    std::vector<char> probe_buf(probe_size, 0);
+    struct io_uring_probe* probe = (struct io_uring_probe*)probe_buf.data();
+    bool ok = (params.features & IORING_FEAT_SINGLE_MMAP) && !syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256);
+
+    if (ok) {
+        for (int op : { IORING_OP_OPENAT, IORING_OP_CLOSE }) {
+            if ((op > probe->last_op) || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                ok = false;
+        }
+    }
+
+    close(fd);
+    return ok;
+}
+
+bool io_uring_t::init()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring_fd = syscall(__NR_io_uring_setup, 2 * BATCH, &params);
+    if (ring_fd < 0)
+        return false;
+
+    // IORING_FEAT_SINGLE_MMAP (checked in supported): SQ and CQ rings share one mapping
+    ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    ring_ptr = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+    if ((ring_ptr == MAP_FAILED) || (sqes == MAP_FAILED)) {
+        printf("ERROR: io_uring mmap failed: %d (%s)\n", errno, strerror(errno));
+        return false;
+    }
+
+    char* ptr = (char*)ring_ptr;
+    sq_head = (unsigned*)(ptr + params.sq_off.head);
+    sq_tail = (unsigned*)(ptr + params.sq_off.tail);
+    sq_array = (unsigned*)(ptr + params.sq_off.array);
+    sq_mask = *(unsigned*)(ptr + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sqe_head = sqe_tail = *sq_tail;
+
+    cq_head = (unsigned*)(ptr + params.cq_off.head);
+    cq_tail = (unsigned*)(ptr + params.cq_off.tail);
+    cq_mask = *(unsigned*)(ptr + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(ptr + params.cq_off.cqes);
+    return true;
+}
+
+io_uring_t::~io_uring_t()
+{
+    release();
+}
+
+void io_uring_t::release()
+{
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqes_size);
+    if (ring_ptr != MAP_FAILED)
+        munmap(ring_ptr, ring_size);
+    if (ring_fd >= 0)
+        close(ring_fd);
+
+    sqes = (struct io_uring_sqe*)MAP_FAILED;
+    ring_ptr = MAP_FAILED;
+    ring_fd = -1;
+}
+
+struct io_uring_sqe* io_uring_t::get_sqe()
+{
+    unsigned index = sqe_tail & sq_mask;
+    struct io_uring_sqe* sqe = &sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    sqe_tail++;
+    return sqe;
+}
+
+void io_uring_t::prep_openat(int dirfd, const char* path, int flags, uint64_t user_data)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dirfd;
+    sqe->addr = (uint64_t)(uintptr_t)path;
+    sqe->open_flags = flags;
+    sqe->user_data = user_data;
+}
+
+void io_uring_t::prep_close(int fd)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = CLOSE_TAG;
+    pending_closes++;
+}
+
+bool io_uring_t::submit_and_wait(unsigned wait_nr)
+{
+    // Publish the new SQEs to the kernel
+    if (sqe_head != sqe_tail) {
+        sqe_head = sqe_tail;
+        __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+    }
+
+    for (;;) {
+        // Everything not consumed yet, including what's left from a short submit
+        unsigned to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+
+        if (ret >= 0)
             return true;
+        if (errno != EINTR) {
+            printf("ERROR: io_uring_enter failed: %d (%s)\n", errno, strerror(errno));
+            return false;
+        }
+    }
+}
+
+void io_uring_t::abandon(std::vector<int>& unsubmitted_closes)
+{
+    for (unsigned i = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE); i != sqe_tail; i++) {
+        const struct io_uring_sqe* sqe = &sqes[sq_array[i & sq_mask]];
+
+        if (sqe->opcode == IORING_OP_CLOSE)
+            unsubmitted_closes.push_back(sqe->fd);
+    }
+
+    pending_closes = 0;
+    release();
+}
+
+struct io_uring_cqe* io_uring_t::peek_cqe()
+{
+    unsigned head = *cq_head;
+
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        return nullptr;
+    return &cqes[head & cq_mask];
+}
+#endif // HAVE_IO_URING
+
+/*
+ * Sacrificial thread reading directories on network filesystems. A hung
+ * server blocks open() and getdents64 until it comes back, so scan threads
+ * wait with a deadline. On timeout the worker is abandoned (likely stuck in
+ * D state) and deletes itself if its syscall ever returns.
+ */
+class netfs_worker_t {
+public:
+    // Start worker thread. Returns nullptr on failure.
+    static netfs_worker_t* create();
+
+    // Open and read directory path, read_size bytes per getdents64 call so each chunk
+    // fits the caller's getdents_buffer_t. Returns false on timeout: the worker
+    // has been abandoned and must not be used again.
+    bool read_dir(const std::string& path, size_t read_size, unsigned timeout_secs);
+
+    // Stop the (idle) worker thread. The worker deletes itself.
+    void quit();
+
+public:
+    // Results of read_dir(): errno of open or getdents64 (0 on success),
+    // directory inode, and getdents64 results stored back to back.
+    // If path is an automount point it is left alone and automount is set.
+    int err = 0;
+    bool automount = false;
+    ino64_t ino = 0;
+    std::vector<char> data;
+    std::vector<int> chunks;
+
+private:
+    static void* threadproc(void* arg);
+
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond;
+    std::string path;
+    size_t read_size = 0;
+    bool pending = false;
+    bool abandoned = false;
+    bool quitting = false;
+};
+
+/*
+ * thread info
+ */
+class thread_info_t {
+public:
+    thread_info_t(thread_shared_data_t& tdata_in)
+        : tdata(tdata_in)
+    {
+    }
+    ~thread_info_t() { }
+
+    void queue_directory(dirqueue_entry_t* parent, const char* d_name, ino64_t ino, const scan_mount_t& mount,
+        const mount_trie_t* mount_trie, const ignore_matcher_t::state_t* ignore_state);
+    void push_directory(dirqueue_entry_t* entry);
+    // Pop directory off our queue. If steal is set, try elevators and other threads' queues next.
+    dirqueue_entry_t* dequeue_directory(bool steal = true);
+
+    // Take the next directory from an elevator with a free slot
+    dirqueue_entry_t* dequeue_elevator();
+
+    // Steal from the deques of victims (thread indexes)
+    dirqueue_entry_t* steal_directory(const std::vector<uint32_t>& victims);
+
+    // Done scanning a dequeued directory
+    void finish_directory(dirqueue_entry_t* entry);
+
+    // Park until a directory is queued. Returns nullptr once the scan is finished.
+    dirqueue_entry_t* wait_for_directory();
+
+    // Returns -1: queue empty, 0: open error, > 0 success
+    int parse_dirqueue_entry();
+
+    // Open and scan a dequeued directory. Returns 0: open error, > 0 success
+    int parse_directory(dirqueue_entry_t* entry);
+
+#if HAVE_IO_URING
+    // Open a batch of queued directories with io_uring and scan them.
+    // Returns -1: queue empty, 0: nothing opened, > 0 success
+    int parse_dirqueue_batch();
+
+    // Wait for queued closes to complete
+    void flush_closes();
+
+    // Stop using a ring that failed, closing the fds it still holds
+    void abandon_ring();
+#endif
+
+
+    // Scan opened directory, or directory read by remote if fd is -1.
+    // Returns true if fd was kept open for children.
+    bool scan_directory(dirqueue_entry_t* entry, int fd, const netfs_worker_t* remote = nullptr);
+
+    // Read and scan directory on a network filesystem with a deadline
+    void scan_netfs_directory(dirqueue_entry_t* entry);
+
+    // Get dirfd and path to open queued directory relative to the closest
+    // parent with an open fd. path points to entry->name or relpath.
+    int get_open_path(const dirqueue_entry_t* entry, std::string& relpath, const char*& path);
+
+    // Open queued directory relative to the closest parent with an open fd
+    int open_directory(const dirqueue_entry_t* entry);
+
+    // Returns true if entry is a network filesystem automount point we shouldn't open
+    bool is_automount_point(const dirqueue_entry_t* entry, int dirfd, const char* path);
+
+    // Update mount for a directory found to be a mount root. Returns false to skip it.
+    bool check_new_mount(dirqueue_entry_t* entry, scan_mount_t& mount);
+
+    void add_filename(ino64_t inode, dev_t dev, const dirqueue_entry_t* entry, const char* d_name, bool is_dir);
+    void add_filename(ino64_t inode, dev_t dev, const std::string& filename);
+
+public:
+    uint32_t idx = 0;
+    pthread_t pthread_id = 0;
+    // xorshift state for picking steal victims
+    uint32_t rand_state = 0;
+    // Allocator for our queued directories
+    scan_arena_t* arena = nullptr;
+    // Directory handed to us by an elevator, dequeued first
+    dirqueue_entry_t* next_entry = nullptr;
+    // Worker group we belong to
+    int group = 0;
+    // Indexes of all threads, for stealing from any group
+    std::vector<uint32_t> all_threads;
+
+    thread_shared_data_t& tdata;
+
+    // Total dirs scanned by this thread
+    uint32_t scanned_dirs = 0;
+    // getdents64 calls made by this thread, and estimate of calls with a 1 KiB buffer
+    uint64_t getdents_calls = 0;
+    uint64_t getdents_calls_1k = 0;
+    getdents_buffer_t getdents_buf;
+#if HAVE_IO_URING
+    io_uring_t ring;
+#endif
+    // Reads directories on network filesystems, created on first use
+    netfs_worker_t* netfs = nullptr;
+    // Files found by this thread
+    std::vector<filename_info_t> found_files;
+};
+
+/*
+ * getdents64 syscall
+ */
+GCC_DIAG_PUSH_OFF(pedantic)
+struct linux_dirent64 {
+    uint64_t d_ino; // Inode number
+    int64_t d_off; // Offset to next linux_dirent
+    unsigned short d_reclen; // Length of this linux_dirent
+    unsigned char d_type; // File type
+    char d_name[]; // Filename (null-terminated)
+};
+GCC_DIAG_POP()
+
+int sys_getdents64(int fd, char* dirp, int count)
+{
+    return syscall(SYS_getdents64, fd, dirp, count);
+}
+
+static double gettime()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+std::string string_formatv(const char* fmt, va_list ap)
+{
+    std::string str;
+    int size = 512;
+
+    for (;;) {
+        str.resize(size);
+        int n = vsnprintf((char*)str.c_str(), size, fmt, ap);
+
+        if ((n > -1) && (n < size)) {
+            str.resize(n);
+            return str;
+        }
+
+        size = (n > -1) ? (n + 1) : (size * 2);
+    }
+}
+
+std::string string_format(const char* fmt, ...)
+{
+    va_list ap;
+    std::string str;
+
+    va_start(ap, fmt);
+    str = string_formatv(fmt, ap);
+    va_end(ap);
+
+    return str;
+}
+
+static std::string get_link_name(const char* pathname)
+{
+    std::string Result;
+    char filename[PATH_MAX + 1];
+
+    ssize_t ret = readlink(pathname, filename, sizeof(filename));
+    if ((ret > 0) && (ret < (ssize_t)sizeof(filename))) {
+        filename[ret] = 0;
+        Result = filename;
+    }
+    return Result;
+}
+
+/*
+ * Per-thread /proc reader. Everything is opened relative to /proc and /proc/<pid>
+ * dirfds, and read into buffers reused across processes, so looking at an fd
+ * doesn't allocate or walk a full path.
+ */
+class procfs_reader_t {
+public:
+    static const size_t DENTS_SIZE = 32 * 1024;
+
+    procfs_reader_t(int dirfd)
+        : proc_fd(dirfd)
+    {
+    }
+    ~procfs_reader_t() { close_pid(); }
+    procfs_reader_t(const procfs_reader_t&) = delete;
+    procfs_reader_t& operator=(const procfs_reader_t&) = delete;
+
+    // Open /proc/<pid>. Returns false if the process is gone.
+    bool open_pid(pid_t pid);
+    void close_pid();
+
+    // Read link name relative to dirfd into buf. Returns length, -1 on error or truncation.
+    static ssize_t read_link(int dirfd, const char* name, char* buf, size_t size);
+
+    // Read fdinfo/<name> of the open pid into data. Returns length, -1 on error.
+    ssize_t read_fdinfo(const char* name);
+
+    // Returns uid of the open pid, -1 on error. /proc/<pid> is owned by the process uid.
+    uid_t get_uid();
+
+    // getdents64 buffer, allocated on first use
+    char* get_dents();
+
+public:
+    int proc_fd; // /proc
+    int pid_fd = -1; // /proc/<pid>
+    int fdinfo_fd = -1; // /proc/<pid>/fdinfo, opened for the first inotify fd
+
+    std::unique_ptr<char[]> dents;
+    // Contents of the last fdinfo read, with room for a terminating null
+    std::vector<char> data;
+};
+
+bool procfs_reader_t::open_pid(pid_t pid)
+{
+    char name[16];
+
+    close_pid();
+    snprintf(name, sizeof(name), "%d", pid);
+    pid_fd = openat(proc_fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    return pid_fd >= 0;
+}
+
+void procfs_reader_t::close_pid()
+{
+    if (fdinfo_fd >= 0)
+        close(fdinfo_fd);
+    if (pid_fd >= 0)
+        close(pid_fd);
+    fdinfo_fd = -1;
+    pid_fd = -1;
+}
+
+ssize_t procfs_reader_t::read_link(int dirfd, const char* name, char* buf, size_t size)
+{
+    ssize_t ret = readlinkat(dirfd, name, buf, size);
+
+    if ((ret <= 0) || (ret >= (ssize_t)size))
+        return -1;
+    buf[ret] = 0;
+    return ret;
+}
+
+ssize_t procfs_reader_t::read_fdinfo(const char* name)
+{
+    if (fdinfo_fd < 0)
+        fdinfo_fd = openat(pid_fd, "fdinfo", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    int fd = openat(fdinfo_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (data.empty())
+        data.resize(64 * 1024);
+
+    size_t len = 0;
+    for (;;) {
+        if (data.size() - len < 4096)
+            data.resize(data.size() * 2);
+
+        ssize_t ret = read(fd, &data[len], data.size() - len - 1);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        len += ret;
+    }
+    close(fd);
+
+    data[len] = 0;
+    return len;
+}
+
+uid_t procfs_reader_t::get_uid()
+{
+    struct stat st;
+
+    if (fstat(pid_fd, &st))
+        return -1;
+    return st.st_uid;
+}
+
+char* procfs_reader_t::get_dents()
+{
+    if (!dents)
+        dents.reset(new char[DENTS_SIZE]);
+    return dents.get();
+}
+
+// Hex digit values, -1 for everything else (including the terminating null)
+static const struct hex_table_t {
+    hex_table_t()
+    {
+        memset(val, -1, sizeof(val));
+        for (int i = 0; i < 10; i++)
+            val['0' + i] = i;
+        for (int i = 0; i < 6; i++)
+            val['a' + i] = val['A' + i] = 10 + i;
+    }
+
+    int8_t val[256];
+} hex_table;
+
+// Parse hex number at str. Returns pointer past the digits.
+static inline const char* parse_hex(const char* str, uint64_t& val)
+{
+    uint64_t ret = 0;
+
+    for (int8_t digit; (digit = hex_table.val[(unsigned char)*str]) >= 0; str++)
+        ret = (ret << 4) | digit;
+
+    val = ret;
+    return str;
+}
+
+/*
+ * Fields of an fdinfo inotify line we care about
+ */
+struct inotify_line_t {
+    uint64_t ino = 0;
+    uint64_t sdev = 0;
+    uint64_t handle_bytes = 0;
+    uint64_t handle_type = 0;
+    const char* handle = nullptr; // f_handle hex digits
+};
+
+// Parse "wd:1 ino:80001 sdev:800011 mask:100 ignored_mask:0 fhandle-bytes:8 fhandle-type:1 f_handle:01000800bc1b8c7c"
+// laid out the way the kernel prints it. Returns false if the line looks any different.
+static bool parse_inotify_line_fast(const char* str, inotify_line_t& line)
+{
+    uint64_t unused;
+    auto field = [&str](const char* key, size_t len, uint64_t& val) {
+        if (memcmp(str, key, len))
+            return false;
+        str = parse_hex(str + len, val);
+        return true;
+    };
+
+    if (!field("wd:", 3, unused) || !field(" ino:", 5, line.ino) || !field(" sdev:", 6, line.sdev)
+        || !field(" mask:", 6, unused) || !field(" ignored_mask:", 14, unused))
+        return false;
+
+    // No file handle without CONFIG_EXPORTFS
+    if (!*str)
+        return true;
+
+    if (!field(" fhandle-bytes:", 15, line.handle_bytes) || !field(" fhandle-type:", 14, line.handle_type)
+        || memcmp(str, " f_handle:", 10))
+        return false;
+
+    line.handle = str + 10;
+    return true;
+}
+
+// Parse fdinfo inotify line fields in any order. Fields we don't use (wd, mask,
+// ignored_mask) are skipped.
+static void parse_inotify_line(const char* str, inotify_line_t& line)
+{
+    if (parse_inotify_line_fast(str, line))
+        return;
+
+    line = inotify_line_t();
+    while (*str) {
+        const char* key = str;
+
+        while (*str && (*str != ':') && (*str != ' '))
+            str++;
+
+        if (*str == ':') {
+            size_t len = str - key;
+            uint64_t* val = nullptr;
+
+            str++;
+            if ((len == 3) && !memcmp(key, "ino", 3))
+                val = &line.ino;
+            else if ((len == 4) && !memcmp(key, "sdev", 4))
+                val = &line.sdev;
+            else if ((len == 13) && !memcmp(key, "fhandle-bytes", 13))
+                val = &line.handle_bytes;
+            else if ((len == 12) && !memcmp(key, "fhandle-type", 12))
+                val = &line.handle_type;
+            else if ((len == 8) && !memcmp(key, "f_handle", 8))
+                line.handle = str;
+
+            if (val)
+                str = parse_hex(str, *val);
+        }
+
+        while (*str && (*str != ' '))
+            str++;
+        while (*str == ' ')
+            str++;
+    }
+}
+
+// Decode f_handle from an fdinfo inotify line
+static bool get_fhandle_val(const inotify_line_t& line, fhandle_info_t& fhandle)
+{
+    if (!line.handle || !line.handle_bytes || (line.handle_bytes > MAX_HANDLE_SZ))
+        return false;
+
+    fhandle.handle_type = line.handle_type;
+    fhandle.handle.resize(line.handle_bytes);
+
+    const unsigned char* str = (const unsigned char*)line.handle;
+    for (size_t i = 0; i < line.handle_bytes; i++, str += 2) {
+        int hi = hex_table.val[str[0]];
+        // Don't look past the terminating null
+        int lo = (hi >= 0) ? hex_table.val[str[1]] : -1;
+
+        // Truncated handles are useless to open_by_handle_at()
+        if (lo < 0)
+            return false;
+        fhandle.handle[i] = (hi << 4) | lo;
+    }
+
+    return true;
+}
+
+static uint32_t inotify_parse_fdinfo_file(procfs_reader_t& reader, procinfo_t& procinfo, const char* fd_name)
+{
+    uint32_t watch_count = 0;
+
+    ssize_t len = reader.read_fdinfo(fd_name);
+    if (len >= 0) {
+        char fdset_name[64];
+
+        snprintf(fdset_name, sizeof(fdset_name), "/proc/%d/fdinfo/%s", procinfo.pid, fd_name);
+        procinfo.fdset_filenames.push_back(fdset_name);
+
+        // Watches are mostly on one device: skip the dev_map lookup for repeats
+        uint64_t last_sdev = UINT64_MAX;
+        std::unordered_set<ino64_t>* inodes = nullptr;
+
+        char* end = &reader.data[len];
+        for (char *line_buf = &reader.data[0], *next; line_buf < end; line_buf = next) {
+            char* eol = (char*)memchr(line_buf, '\n', end - line_buf);
+
+            next = eol ? (eol + 1) : end;
+
+            // Terminate this line for the parser
+            if (eol)
+                *eol = 0;
+
+            /* sample fdinfo; inotify line added in linux 3.8, available if
+             * kernel compiled with CONFIG_INOTIFY_USER and CONFIG_PROC_FS
+             *   pos:    0
+             *   flags:  00
+             *   mnt_id: 15
+             *   ino:    5865
+             *   inotify wd:1 ino:80001 sdev:800011 mask:100 ignored_mask:0 fhandle-bytes:8 fhandle-type:1 f_handle:01000800bc1b8c7c
+             */
+            if (!memcmp(line_buf, "inotify ", 8)) {
+                inotify_line_t line;
+
+                watch_count++;
+                // Only processes we're looking for need their inodes and handles
+                if (!procinfo.in_cmd_line)
+                    continue;
+                parse_inotify_line(line_buf + 8, line);
+
+                if (line.ino) {
+                    // https://unix.stackexchange.com/questions/645937/listing-the-files-that-are-being-watched-by-inotify-instances
+                    //   Assuming that the sdev field is encoded according to Linux's so-called "huge
+                    //   encoding", which uses 20 bits (instead of 8) for minor numbers, in bitwise
+                    //   parlance the major number is sdev >> 20 while the minor is sdev & 0xfffff.
+                    unsigned int major = line.sdev >> 20;
+                    unsigned int minor = line.sdev & 0xfffff;
+
+                    // Add inode to this device map
+                    if (line.sdev != last_sdev) {
+                        inodes = &procinfo.dev_map[makedev(major, minor)];
+                        last_sdev = line.sdev;
+                    }
+                    inodes->insert(line.ino);
+
+                    fhandle_info_t fhandle;
+
+                    if (get_fhandle_val(line, fhandle)) {
+                        fhandle.inode = line.ino;
+                        fhandle.dev = makedev(major, minor);
+                        procinfo.fhandles.push_back(std::move(fhandle));
+                    }
+                }
+            }
+        }
+    }
+
+    return watch_count;
+}
+
+static bool is_proc_in_cmdline_applist(const procinfo_t& procinfo, const std::vector<std::string>& cmdline_applist)
+{
+    for (const std::string& str : cmdline_applist) {
+        // Check if our command line string is a subset of this appname
+        if (strstr(procinfo.appname.c_str(), str.c_str()))
+            return true;
+
+        // Check if the PIDs match
+        if (atoll(str.c_str()) == procinfo.pid)
+            return true;
+    }
+
+    return false;
+}
+
+// Read executable and uid of the open pid, and check it against cmdline_applist.
+// Returns false if there's no executable.
+static bool init_procinfo_exe(procfs_reader_t& reader, procinfo_t& procinfo, const std::vector<std::string>& cmdline_applist)
+{
+    char executable[PATH_MAX + 1];
+
+    if (procfs_reader_t::read_link(reader.pid_fd, "exe", executable, sizeof(executable)) <= 0)
+        return false;
+
+    procinfo.uid = reader.get_uid();
+    procinfo.executable = executable;
+    procinfo.appname = basename((char*)procinfo.executable.c_str());
+    procinfo.in_cmd_line = is_proc_in_cmdline_applist(procinfo, cmdline_applist);
+    return true;
+}
+
+static void inotify_parse_fddir(procfs_reader_t& reader, procinfo_t& procinfo, const std::vector<std::string>& cmdline_applist)
+{
+    int fd_dir = openat(reader.pid_fd, "fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd_dir < 0)
+        return;
+
+    char* buf = reader.get_dents();
+
+    for (;;) {
+        int ret = sys_getdents64(fd_dir, buf, procfs_reader_t::DENTS_SIZE);
+        if (ret <= 0)
+            break;
+
+        for (int bpos = 0; bpos < ret;) {
+            struct linux_dirent64* dirp = (struct linux_dirent64*)(buf + bpos);
+
+            if ((dirp->d_type == DT_LNK) && isdigit(dirp->d_name[0])) {
+                // Longer links aren't inotify fds
+                char link_name[32];
+                ssize_t len = procfs_reader_t::read_link(fd_dir, dirp->d_name, link_name, sizeof(link_name));
+
+                if (((len == 18) && !memcmp(link_name, "anon_inode:inotify", 18)) || ((len == 7) && !memcmp(link_name, "inotify", 7))) {
+                    // Few processes have inotify instances: look at the rest of them now.
+                    // We need to know whether we're resolving this one before parsing fdinfo.
+                    if (!procinfo.instances && !init_procinfo_exe(reader, procinfo, cmdline_applist))
+                        break;
+
+                    procinfo.instances++;
+                    procinfo.watches += inotify_parse_fdinfo_file(reader, procinfo, dirp->d_name);
+                }
+            }
+
+            bpos += dirp->d_reclen;
+        }
+    }
+
+    close(fd_dir);
+}
+
+static dirqueue_entry_t* new_dirqueue_entry(scan_arena_t& arena, dirqueue_entry_t* parent, const char* d_name, ino64_t ino, const scan_mount_t& mount,
+    const mount_trie_t* mount_trie, const ignore_matcher_t::state_t* ignore_state)
+{
+    size_t len = strlen(d_name);
+    dirqueue_entry_t* entry = arena.alloc_entry(sizeof(dirqueue_entry_t) + len + 1);
+
+    if (entry) {
+        entry->parent = parent;
+        entry->refcount = 1;
+        entry->fd = -1;
+        entry->ino = ino;
+        entry->dev = mount.dev;
+        entry->mnt_id = mount.mnt_id;
+        entry->elevator = mount.elevator;
+        entry->group = mount.group;
+        entry->is_netfs = mount.is_netfs;
+        entry->is_btrfs = mount.is_btrfs;
+        entry->mount_trie = mount_trie;
+        entry->ignore_state = ignore_state;
+        entry->namelen = len;
+        memcpy(entry->name, d_name, len + 1);
+
+        // Children keep their parent (and its fd) alive
+        if (parent)
+            __atomic_add_fetch(&parent->refcount, 1, __ATOMIC_RELAXED);
+    }
+
+    return entry;
+}
+
+void thread_info_t::queue_directory(dirqueue_entry_t* parent, const char* d_name, ino64_t ino, const scan_mount_t& mount,
+    const mount_trie_t* mount_trie, const ignore_matcher_t::state_t* ignore_state)
+{
+    dirqueue_entry_t* entry = new_dirqueue_entry(*arena, parent, d_name, ino, mount, mount_trie, ignore_state);
+
+    if (entry)
+        push_directory(entry);
+}
+
+void thread_info_t::push_directory(dirqueue_entry_t* entry)
+{
+    tdata.work_outstanding++;
+
+    bool can_start = true;
+
+    if (entry->elevator >= 0) {
+        elevator_t& elevator = *tdata.elevators[entry->elevator];
+
+        pthread_mutex_lock(&elevator.lock);
+        elevator.pending.emplace(entry->ino, entry);
+        elevator.pending_count++;
+        // Threads scanning this device pick up the next directory themselves
+        can_start = elevator.active < elevator_t::MAX_ACTIVE;
+        pthread_mutex_unlock(&elevator.lock);
+    } else if (g_use_lfqueue)
+        tdata.dirqueues[idx].queue_directory(entry);
+    else if (entry->group != group)
+        tdata.push_inbox(entry);
+    else
+        tdata.ws_deques[idx].push(entry);
+
+    // Pairs with idle_threads++ in wait_for_directory(): either we see the parked
+    // thread or it sees our entry when it checks the queues again.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (can_start && tdata.idle_threads.load(std::memory_order_relaxed))
+        tdata.wake_threads(false);
+}
+
+void thread_info_t::finish_directory(dirqueue_entry_t* entry)
+{
+    if (entry->elevator >= 0) {
+        // Hang on to our elevator slot and take the next directory on the same device
+        if (!next_entry)
+            next_entry = tdata.elevator_next(entry->elevator);
+        else
+            tdata.elevator_next(entry->elevator, false);
+    }
+
+    tdata.finish_dirqueue_entry(entry, *arena);
+}
+
+dirqueue_entry_t* thread_info_t::wait_for_directory()
+{
+    dirqueue_entry_t* entry = nullptr;
+
+    pthread_mutex_lock(&tdata.work_lock);
+    tdata.idle_threads++;
+
+    // Other threads are still scanning while work is outstanding, and can queue more
+    while (!tdata.all_inodes_found()) {
+        if (!tdata.work_outstanding.load()) {
+            if (tdata.deferred_dirs.empty())
+                break;
+
+            // Everything else is done and we're still missing inodes: queue deferred directories.
+            // Hold off other threads seeing no work while we push them without the lock.
+            std::vector<dirqueue_entry_t*> deferred_dirs;
+
+            deferred_dirs.swap(tdata.deferred_dirs);
+            tdata.work_outstanding++;
+            pthread_mutex_unlock(&tdata.work_lock);
+
+            for (dirqueue_entry_t* deferred : deferred_dirs)
+                push_directory(deferred);
+            if (!--tdata.work_outstanding)
+                tdata.wake_threads(true);
+
+            pthread_mutex_lock(&tdata.work_lock);
+        }
+
+        entry = dequeue_directory();
+        if (entry)
+            break;
+
+        pthread_cond_wait(&tdata.work_cond, &tdata.work_lock);
+    }
+
+    tdata.idle_threads--;
+    pthread_mutex_unlock(&tdata.work_lock);
+    return entry;
+}
+
+void thread_shared_data_t::wake_threads(bool all)
+{
+    pthread_mutex_lock(&work_lock);
+    if (all)
+        pthread_cond_broadcast(&work_cond);
+    else
+        pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&work_lock);
+}
+
+void thread_shared_data_t::defer_directory(dirqueue_entry_t* entry)
+{
+    pthread_mutex_lock(&work_lock);
+    deferred_dirs.push_back(entry);
+    pthread_mutex_unlock(&work_lock);
+}
+
+void thread_shared_data_t::set_netfs_timed_out(int mnt_id, const std::string& path)
+{
+    pthread_mutex_lock(&netfs_lock);
+    netfs_timeouts.push_back(path);
+    if (netfs_stale_mounts.insert(mnt_id).second)
+        netfs_num_stale++;
+    pthread_mutex_unlock(&netfs_lock);
+}
+
+bool thread_shared_data_t::is_netfs_stale(int mnt_id)
+{
+    if (!netfs_num_stale.load(std::memory_order_relaxed))
+        return false;
+
+    pthread_mutex_lock(&netfs_lock);
+    bool stale = netfs_stale_mounts.count(mnt_id) != 0;
+    pthread_mutex_unlock(&netfs_lock);
+    return stale;
+}
+
+dirqueue_entry_t* elevator_t::pop_next()
+{
+    // Next inode after the last one handed out, wrapping around to the lowest
+    auto it = pending.lower_bound(std::make_pair(head, (dirqueue_entry_t*)nullptr));
+
+    if (it == pending.end())
+        it = pending.begin();
+
+    dirqueue_entry_t* entry = it->second;
+
+    head = it->first;
+    pending.erase(it);
+    pending_count--;
+    return entry;
+}
+
+dirqueue_entry_t* thread_shared_data_t::elevator_next(int index, bool take_next)
+{
+    elevator_t& elevator = *elevators[index];
+    dirqueue_entry_t* entry = nullptr;
+
+    pthread_mutex_lock(&elevator.lock);
+    if (take_next && !elevator.pending.empty())
+        entry = elevator.pop_next();
+    else
+        elevator.active--;
+    pthread_mutex_unlock(&elevator.lock);
+
+    return entry;
+}
+
+void thread_shared_data_t::finish_dirqueue_entry(dirqueue_entry_t* entry, scan_arena_t& arena)
+{
+    release_dirqueue_entry(entry, arena);
+
+    // Last directory finished: nothing more will be queued
+    if (!--work_outstanding)
+        wake_threads(true);
+}
+
+void thread_shared_data_t::release_dirqueue_entry(dirqueue_entry_t* entry, scan_arena_t& arena)
+{
+    while (entry && !__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL)) {
+        dirqueue_entry_t* parent = entry->parent;
+
+        if (entry->fd >= 0) {
+            close(entry->fd);
+            fds_available++;
+        }
+
+        arena.free_entry(entry);
+        entry = parent;
+    }
+}
+
+void thread_shared_data_t::init_fd_cache()
+{
+    struct rlimit rlim;
+    // Leave room for stdio and the directories each thread has open
+    int reserved = 64 + 2 * numqueues;
+    int limit = 1024;
+
+    if (!getrlimit(RLIMIT_NOFILE, &rlim) && (rlim.rlim_cur != RLIM_INFINITY))
+        limit = std::min<rlim_t>(rlim.rlim_cur, 64 * 1024);
+
+#if HAVE_IO_URING
+    if (g_use_io_uring) {
+        // io_uring threads have a batch of directories open plus a batch of closes in
+        // flight. Give batches up to half of what's left, and the fd cache the rest.
+        int batch = (limit - reserved) / (4 * (int)numqueues);
+
+        io_uring_batch = std::min<int>(std::max(batch, 1), io_uring_t::BATCH);
+        reserved += 2 * io_uring_batch * numqueues;
+    }
+#endif
+
+    fds_available = std::max(limit - reserved, 0);
+}
+
+bool thread_shared_data_t::reserve_cached_fd()
+{
+    if (--fds_available >= 0)
+        return true;
+
+    fds_available++;
+    return false;
+}
+
+// Returns full path of queued directory with trailing slash
+static std::string get_dirqueue_entry_path(const dirqueue_entry_t* entry)
+{
+    size_t len = 0;
+
+    for (const dirqueue_entry_t* e = entry; e; e = e->parent)
+        len += e->namelen + (e->parent ? 1 : 0);
+
+    std::string path(len, '/');
+
+    for (const dirqueue_entry_t* e = entry; e; e = e->parent) {
+        if (e->parent)
+            len--;
+        len -= e->namelen;
+        memcpy(&path[len], e->name, e->namelen);
+    }
+
+    return path;
+}
+
+static const int DIR_OPEN_FLAGS = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+
+int thread_info_t::get_open_path(const dirqueue_entry_t* entry, std::string& relpath, const char*& path)
+{
+    path = entry->name;
+
+    if (!entry->parent)
+        return AT_FDCWD;
+
+    if (entry->parent->fd >= 0)
+        return entry->parent->fd;
+
+    // Build path relative to the closest parent which still has an open fd
+    const dirqueue_entry_t* base = entry->parent;
+    relpath = entry->name;
+
+    for (; base->parent && (base->fd < 0); base = base->parent)
+        relpath = std::string(base->name, base->namelen) + "/" + relpath;
+
+    if (base->fd < 0)
+        relpath = std::string(base->name, base->namelen) + relpath;
+
+    path = relpath.c_str();
+    return (base->fd >= 0) ? base->fd : AT_FDCWD;
+}
+
+static bool stat_is_automount(int dirfd, const char* filename);
+
+int thread_info_t::open_directory(const dirqueue_entry_t* entry)
+{
+    std::string relpath;
+    const char* path;
+    int dirfd = get_open_path(entry, relpath, path);
+
+    if (is_automount_point(entry, dirfd, path)) {
+        errno = EREMOTE;
+        return -1;
+    }
+
+    return openat(dirfd, path, DIR_OPEN_FLAGS);
+}
+
+bool thread_info_t::is_automount_point(const dirqueue_entry_t* entry, int dirfd, const char* path)
+{
+    // Opening an automount point (nfs4 referral, DFS link, ...) mounts it. With
+    // --netfs-timeout the netfs worker checks this itself.
+    if (!entry->is_netfs || g_include_automounts || !stat_is_automount(dirfd, path))
+        return false;
+
+    if (g_verbose > 1) {
+        printf("Skipping automount point '%s'\n", get_dirqueue_entry_path(entry).c_str());
+    }
+    return true;
+}
+
+netfs_worker_t* netfs_worker_t::create()
+{
+    netfs_worker_t* worker = new netfs_worker_t;
+    pthread_condattr_t attr;
+    pthread_t thread;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&worker->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&thread, NULL, &threadproc, worker)) {
+        printf("Warning: pthread_create failed. errno: %d\n", errno);
+        pthread_cond_destroy(&worker->cond);
+        delete worker;
+        return nullptr;
+    }
+
+    pthread_detach(thread);
+    return worker;
+}
+
+void* netfs_worker_t::threadproc(void* arg)
+{
+    netfs_worker_t* worker = (netfs_worker_t*)arg;
+
+    pthread_mutex_lock(&worker->lock);
+
+    for (;;) {
+        while (!worker->pending && !worker->quitting)
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        if (worker->quitting)
+            break;
+
+        std::string path = worker->path;
+        size_t read_size = worker->read_size;
+        pthread_mutex_unlock(&worker->lock);
+
+        // Everything from here to the lock may block forever
+        std::vector<char> data;
+        std::vector<int> chunks;
+        ino64_t ino = 0;
+        int err = 0;
+        // Opening an automount point (nfs4 referral, DFS link, ...) mounts it
+        bool automount = !g_include_automounts && stat_is_automount(AT_FDCWD, path.c_str());
+        int fd = automount ? -1 : open(path.c_str(), DIR_OPEN_FLAGS);
+
+        if (automount) {
+            err = EREMOTE;
+        } else if (fd < 0) {
+            err = errno;
+        } else {
+            struct stat statbuf;
+
+            if (!fstat(fd, &statbuf))
+                ino = statbuf.st_ino;
+
+            for (;;) {
+                size_t pos = data.size();
+
+                data.resize(pos + read_size);
+                int ret = sys_getdents64(fd, &data[pos], read_size);
+
+                if (ret < 0)
+                    err = errno;
+                data.resize(pos + std::max(ret, 0));
+                if (ret <= 0)
+                    break;
+                chunks.push_back(ret);
+            }
+            close(fd);
+        }
+
+        pthread_mutex_lock(&worker->lock);
+        if (worker->abandoned)
+            break;
+
+        worker->err = err;
+        worker->automount = automount;
+        worker->ino = ino;
+        worker->data.swap(data);
+        worker->chunks.swap(chunks);
+        worker->pending = false;
+        pthread_cond_broadcast(&worker->cond);
+    }
+
+    pthread_mutex_unlock(&worker->lock);
+    pthread_cond_destroy(&worker->cond);
+    delete worker;
+    return nullptr;
+}
+
+bool netfs_worker_t::read_dir(const std::string& dir_path, size_t dir_read_size, unsigned timeout_secs)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_secs;
+
+    pthread_mutex_lock(&lock);
+    path = dir_path;
+    read_size = dir_read_size;
+    pending = true;
+    pthread_cond_broadcast(&cond);
+
+    while (pending) {
+        if ((pthread_cond_timedwait(&cond, &lock, &deadline) == ETIMEDOUT) && pending) {
+            abandoned = true;
+            break;
+        }
+    }
+
+    bool ok = !abandoned;
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+void netfs_worker_t::quit()
+{
+    pthread_mutex_lock(&lock);
+    quitting = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+dirqueue_entry_t* thread_info_t::dequeue_directory(bool steal)
+{
+    if (next_entry) {
+        dirqueue_entry_t* entry = next_entry;
+
+        next_entry = nullptr;
+        return entry;
+    }
+
+    if (g_use_lfqueue) {
+        dirqueue_entry_t* entry = tdata.dirqueues[idx].dequeue_directory();
+
+        if (!entry && steal)
+            entry = dequeue_elevator();
+
+        if (!entry && steal) {
+            // Nothing on our queue, check queues on other threads
+            for (lfqueue_wrapper_t& dirq : tdata.dirqueues) {
+                entry = dirq.dequeue_directory();
+                if (entry)
+                    break;
+            }
+        }
+
+        return entry;
+    }
+
+    // Newest directory from our deque: likely a child of what we just scanned
+    dirqueue_entry_t* entry = tdata.ws_deques[idx].pop();
+
+    if (!entry && steal)
+        entry = tdata.pop_inbox(group);
+
+    // Keep rotational devices busy before helping other threads
+    if (!entry && steal)
+        entry = dequeue_elevator();
+
+    // Steal oldest directory from threads in our group, then from any group
+    if (!entry && steal)
+        entry = steal_directory(tdata.groups[group]->members);
+
+    if (!entry && steal) {
+        int num_groups = tdata.num_groups.load(std::memory_order_acquire);
+
+        for (int i = 0; i < num_groups && !entry; i++)
+            entry = tdata.pop_inbox(i);
+    }
+
+    if (!entry && steal)
+        entry = steal_directory(all_threads);
+
+    return entry;
+}
+
+dirqueue_entry_t* thread_info_t::steal_directory(const std::vector<uint32_t>& victims)
+{
+    dirqueue_entry_t* entry = nullptr;
+
+    if (victims.empty())
+        return nullptr;
+
+    // Start with a random victim
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+
+    size_t victim = rand_state % victims.size();
+
+    for (size_t i = 0; i < victims.size() && !entry; i++) {
+        if (victims[victim] != idx)
+            entry = tdata.ws_deques[victims[victim]].steal();
+        if (++victim == victims.size())
+            victim = 0;
+    }
+
+    return entry;
+}
+
+dirqueue_entry_t* thread_info_t::dequeue_elevator()
+{
+    int num_elevators = tdata.num_elevators.load(std::memory_order_acquire);
+
+    for (int i = 0; i < num_elevators; i++) {
+        elevator_t& elevator = *tdata.elevators[i];
+        dirqueue_entry_t* entry = nullptr;
+
+        if (!elevator.pending_count.load(std::memory_order_relaxed))
+            continue;
+
+        pthread_mutex_lock(&elevator.lock);
+        if ((elevator.active < elevator_t::MAX_ACTIVE) && !elevator.pending.empty()) {
+            entry = elevator.pop_next();
+            elevator.active++;
+        }
+        pthread_mutex_unlock(&elevator.lock);
+
+        if (entry)
+            return entry;
+    }
+
+    return nullptr;
+}
+
+// statx() was added to Linux in kernel 4.11; library support was added in glibc 2.28.
+#if defined(__linux__) && ((__GLIBC__ >= 2 && __GLIBC_MINOR__ >= 28) || (__GLIBC__ > 2))
+
+struct statx mystatx(int dirfd, const char* filename, unsigned int mask = 0)
+{
+    struct statx statxbuf;
+    int flags = AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC;
+
+    if (statx(dirfd, filename, flags, mask, &statxbuf) == -1) {
+        printf("ERROR: statx-ino( %s ) failed. Errno: %d (%s)\n", filename, errno, strerror(errno));
+        memset(&statxbuf, 0, sizeof(statxbuf));
+    }
+
+    return statxbuf;
+}
+
+static dev_t stat_get_dev_t(const char* filename)
+{
+    struct statx statxbuf = mystatx(AT_FDCWD, filename);
+
+    return makedev(statxbuf.stx_dev_major, statxbuf.stx_dev_minor);
+}
+
+static uint64_t stat_get_ino(int dirfd, const char* filename)
+{
+    return mystatx(dirfd, filename, STATX_INO).stx_ino;
+}
+
+static bool stat_is_automount(int dirfd, const char* filename)
+{
+#ifdef STATX_ATTR_AUTOMOUNT
+    struct statx statxbuf;
+
+    if (!statx(dirfd, filename, AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW, 0, &statxbuf))
+        return (statxbuf.stx_attributes_mask & STATX_ATTR_AUTOMOUNT) && (statxbuf.stx_attributes & STATX_ATTR_AUTOMOUNT);
+#else
+    (void)dirfd;
+    (void)filename;
+#endif
+
+    return false;
+}
+
+static bool stat_get_mnt_id(int dirfd, const char* filename, uint64_t& ino, int& mnt_id)
+{
+#ifdef STATX_MNT_ID
+    struct statx statxbuf = mystatx(dirfd, filename, STATX_INO | STATX_MNT_ID);
+
+    if (statxbuf.stx_mask & STATX_MNT_ID) {
+        ino = statxbuf.stx_ino;
+        mnt_id = statxbuf.stx_mnt_id;
+        return true;
+    }
+#else
+    (void)dirfd;
+    (void)filename;
+    (void)ino;
+    (void)mnt_id;
+#endif
+
+    return false;
+}
+
+#else
+
+// Fall back to using stat() functions. Should work but be slower than using statx().
+
+static dev_t stat_get_dev_t(const char* filename)
+{
+    struct stat statbuf;
+
+    int ret = stat(filename, &statbuf);
+    if (ret == -1) {
+        printf("ERROR: stat-dev_t( %s ) failed. Errno: %d (%s)\n", filename, errno, strerror(errno));
+        return 0;
+    }
+    return statbuf.st_dev;
+}
+
+static uint64_t stat_get_ino(int dirfd, const char* filename)
+{
+    struct stat statbuf;
+
+    int ret = fstatat(dirfd, filename, &statbuf, AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW);
+    if (ret == -1) {
+        printf("ERROR: stat-ino( %s ) failed. Errno: %d (%s)\n", filename, errno, strerror(errno));
+        return 0;
+    }
+
+    return statbuf.st_ino;
+}
+
+static bool stat_is_automount(int dirfd, const char* filename)
+{
+    (void)dirfd;
+    (void)filename;
+    return false;
+}
+
+static bool stat_get_mnt_id(int dirfd, const char* filename, uint64_t& ino, int& mnt_id)
+{
+    (void)dirfd;
+    (void)filename;
+    (void)ino;
+    (void)mnt_id;
+    return false;
+}
+
+#endif
+
+// Unescape octal sequences (ie "\040" for space) in mountinfo fields
+static std::string mountinfo_unescape(const char* str)
+{
+    std::string ret;
+
+    for (; *str; str++) {
+        if ((str[0] == '\\') && (str[1] >= '0' && str[1] <= '3') && (str[2] >= '0' && str[2] <= '7') && (str[3] >= '0' && str[3] <= '7')) {
+            ret += (char)(((str[1] - '0') << 6) | ((str[2] - '0') << 3) | (str[3] - '0'));
+            str += 3;
+        } else {
+            ret += *str;
+        }
+    }
+
+    return ret;
+}
+
+mount_table_t::~mount_table_t()
+{
+    close_mount_fds();
+}
+
+void mount_table_t::close_mount_fds()
+{
+    for (const auto& it : mount_fds) {
+        if (it.second >= 0)
+            close(it.second);
+    }
+    mount_fds.clear();
+}
+
+bool mount_table_t::load()
+{
+    FILE* fp = fopen("/proc/self/mountinfo", "r");
+    if (!fp) {
+        printf("ERROR: fopen /proc/self/mountinfo failed: %d (%s)\n", errno, strerror(errno));
+        return false;
+    }
+
+    char* line = nullptr;
+    size_t line_size = 0;
+
+    mounts.clear();
+
+    /* sample mountinfo line; see proc(5)
+     *   36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+     *   (1)(2)(3)   (4)   (5)      (6)      (7)   (8) (9)   (10)         (11)
+     */
+    while (getline(&line, &line_size, fp) > 0) {
+        std::vector<char*> fields;
+        char* saveptr = nullptr;
+
+        for (char* tok = strtok_r(line, " \n", &saveptr); tok; tok = strtok_r(nullptr, " \n", &saveptr))
+            fields.push_back(tok);
+
+        // Optional fields are terminated by a single hyphen
+        size_t sep = 6;
+        while ((sep < fields.size()) && strcmp(fields[sep], "-"))
+            sep++;
+        if (sep + 2 >= fields.size())
+            continue;
+
+        unsigned int major = 0;
+        unsigned int minor = 0;
+        if (sscanf(fields[2], "%u:%u", &major, &minor) != 2)
+            continue;
+
+        mount_info_t mount;
+
+        mount.mnt_id = atoi(fields[0]);
+        mount.parent_id = atoi(fields[1]);
+        mount.dev = makedev(major, minor);
+        mount.root = mountinfo_unescape(fields[3]);
+        mount.mount_point = mountinfo_unescape(fields[4]);
+        mount.fstype = fields[sep + 1];
+        mount.source = mountinfo_unescape(fields[sep + 2]);
+        if (sep + 3 < fields.size())
+            mount.super_options = fields[sep + 3];
+
+        mounts.push_back(mount);
+    }
+
+    free(line);
+    fclose(fp);
+    return !mounts.empty();
+}
+
+int mount_table_t::get_mount_fd(const mount_info_t& mount)
+{
+    auto it = mount_fds.find(mount.mnt_id);
+
+    if (it == mount_fds.end()) {
+        // open_by_handle_at() doesn't accept O_PATH mount fds
+        int fd = open(mount.mount_point.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        it = mount_fds.emplace(mount.mnt_id, fd).first;
+    }
+
+    return it->second;
+}
+
+void thread_info_t::add_filename(ino64_t inode, dev_t dev, const dirqueue_entry_t* entry, const char* d_name, bool is_dir)
+{
+    size_t index = tdata.inode_table.find(dev, inode);
+
+    // Only build the path for inodes we're looking for
+    if ((index != inode_table_t::NOT_FOUND) && !tdata.inode_resolved[index]) {
+        std::string filename = get_dirqueue_entry_path(entry) + d_name;
+
+        add_filename(inode, dev, is_dir ? filename + "/" : filename);
+    }
+}
+
+void thread_info_t::add_filename(ino64_t inode, dev_t dev, const std::string& filename)
+{
+    size_t index = tdata.inode_table.find(dev, inode);
+
+    if ((index != inode_table_t::NOT_FOUND) && !tdata.inode_resolved[index]) {
+        filename_info_t fname;
+
+        // Found the last one: let parked threads quit
+        if (tdata.set_inode_found(index) && !tdata.inodes_remaining)
+            tdata.wake_threads(true);
+
+        fname.filename = filename;
+        fname.inode = inode;
+        fname.dev = dev;
+
+        found_files.push_back(fname);
+    }
+}
+
+static bool is_dot_dir(const char* dname)
+{
+    if (dname[0] == '.') {
+        if (!dname[1])
+            return true;
+
+        if ((dname[1] == '.') && !dname[2])
+            return true;
+    }
+
+    return false;
+}
+
+void ignore_matcher_t::add(const std::string& pattern)
+{
+    node_t* node = &any_depth;
+    size_t pos = 0;
+
+    if (!pattern.compare(0, 2, "*/"))
+        pos = 2;
+    else if (pattern[0] == '/') {
+        node = &root;
+        pos = 1;
+    }
+
+    bool added = false;
+    while (pos < pattern.size()) {
+        size_t end = pattern.find('/', pos);
+        if (end == std::string::npos)
+            end = pattern.size();
+
+        std::string name = pattern.substr(pos, end - pos);
+        pos = end + 1;
+        if (name.empty() || (name == "."))
+            continue;
+
+        auto& children = (name.find_first_of("*?[") != std::string::npos) ? node->globs : node->names;
+        auto it = std::lower_bound(children.begin(), children.end(), name,
+            [](const std::pair<std::string, std::unique_ptr<node_t>>& child, const std::string& str) { return child.first < str; });
+
+        if ((it == children.end()) || (it->first != name))
+            it = children.emplace(it, name, std::unique_ptr<node_t>(new node_t));
+        node = it->second.get();
+        added = true;
+    }
+
+    if (added) {
+        node->ignore = true;
+        has_patterns = true;
+    }
+}
+
+const ignore_matcher_t::state_t* ignore_matcher_t::next_slow(const state_t* state, const char* dname, bool& ignore)
+{
+    state_t matches;
+    auto add_match = [&](const node_t* node) {
+        if (node->ignore)
+            ignore = true;
+        else
+            matches.push_back(node);
+    };
+    auto step = [&](const node_t* node) {
+        auto it = std::lower_bound(node->names.begin(), node->names.end(), dname,
+            [](const std::pair<std::string, std::unique_ptr<node_t>>& child, const char* str) { return strcmp(child.first.c_str(), str) < 0; });
+
+        if ((it != node->names.end()) && !strcmp(it->first.c_str(), dname))
+            add_match(it->second.get());
+
+        for (const auto& glob : node->globs) {
+            if (!fnmatch(glob.first.c_str(), dname, 0))
+                add_match(glob.second.get());
+        }
+    };
+
+    step(&any_depth);
+    if (state) {
+        for (const node_t* node : *state)
+            step(node);
+    }
+
+    // Nothing below an ignored directory gets looked at
+    if (ignore || matches.empty())
+        return nullptr;
+
+    std::sort(matches.begin(), matches.end());
+    matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+
+    pthread_mutex_lock(&lock);
+    const state_t* ret = &*states.insert(std::move(matches)).first;
+    pthread_mutex_unlock(&lock);
+
+    return ret;
+}
+
+const ignore_matcher_t::state_t* ignore_matcher_t::path_state(const std::string& path, bool& ignore)
+{
+    ignore = false;
+    if (!has_patterns)
+        return nullptr;
+
+    const state_t* state = nullptr;
+    if (!root.names.empty() || !root.globs.empty()) {
+        pthread_mutex_lock(&lock);
+        state = &*states.insert(state_t(1, &root)).first;
+        pthread_mutex_unlock(&lock);
+    }
+
+    for (size_t pos = 1; pos < path.size();) {
+        size_t end = path.find('/', pos);
+        if (end == std::string::npos)
+            end = path.size();
+
+        if (end > pos) {
+            state = next_slow(state, path.substr(pos, end - pos).c_str(), ignore);
+            if (ignore)
+                return nullptr;
+        }
+        pos = end + 1;
+    }
+
+    return state;
+}
+
+// Returns true for mountinfo filesystem types of proc and FUSE mounts, which are never scanned.
+//   https://github.com/mikesart/inotify-info/issues/6
+static bool is_proc_fstype(const std::string& fstype)
+{
+    return (fstype == "proc") || (fstype == "fuse") || (fstype == "fuseblk") || !fstype.compare(0, 5, "fuse.");
+}
+
+static bool is_netfs_fstype(const std::string& fstype)
+{
+    static const char* netfs_types[] = { "nfs", "nfs4", "cifs", "smb3", "smbfs", "ncpfs", "9p", "ceph", "afs", "coda", "lustre" };
+
+    for (const char* type : netfs_types) {
+        if (fstype == type)
+            return true;
+    }
+    return false;
+}
+
+// Well-known snapshot directory names: NetApp/NFS, snapper, ZFS, SMB (Windows previous versions)
+static bool is_snapshot_dir(const char* dname)
+{
+    if ((dname[0] != '.') && (dname[0] != '~'))
+        return false;
+
+    return !strcmp(dname, ".snapshot") || !strcmp(dname, ".snapshots") || !strcmp(dname, ".zfs") || !strcmp(dname, "~snapshot");
+}
+
+// Returns true if any component of path is a snapshot directory
+static bool is_snapshot_path(const std::string& path)
+{
+    for (size_t pos = 0, end; pos < path.size(); pos = end + 1) {
+        end = path.find('/', pos);
+        if (end == std::string::npos)
+            end = path.size();
+
+        if (is_snapshot_dir(path.substr(pos, end - pos).c_str()))
+            return true;
+    }
+
+    return false;
+}
+
+// Returns true if fd is the root of a btrfs snapshot (a subvolume with a parent)
+static bool is_btrfs_snapshot(int fd)
+{
+#if HAVE_BTRFS_SUBVOL_INFO
+    struct btrfs_ioctl_get_subvol_info_args args;
+
+    if (ioctl(fd, BTRFS_IOC_GET_SUBVOL_INFO, &args))
+        return false;
+
+    for (__u8 byte : args.parent_uuid) {
+        if (byte)
+            return true;
+    }
+#else
+    (void)fd;
+#endif
+
+    return false;
+}
+
+// Pseudo filesystems (and network ones) are only worth a look if a watch is on them
+static fstype_policy_t get_fstype_policy(const std::string& fstype)
+{
+    static const char* targeted_types[] = { "sysfs", "cgroup", "cgroup2", "debugfs", "tracefs", "securityfs", "pstore", "bpf", "configfs",
+        "binfmt_misc", "efivarfs", "fusectl", "selinuxfs", "nsfs", "rpc_pipefs", "devpts", "mqueue", "hugetlbfs" };
+    auto it = fstype_policies.find(fstype);
+
+    if (it != fstype_policies.end())
+        return it->second;
+
+    for (const char* type : targeted_types) {
+        if (fstype == type)
+            return FSTYPE_TARGETED;
+    }
+
+    return is_netfs_fstype(fstype) ? FSTYPE_TARGETED : FSTYPE_INCLUDE;
+}
+
+// Set policy ("include", "targeted" or "exclude") for comma separated fstypes.
+// Returns number of fstypes set.
+static uint32_t set_fstype_policy(const char* policy, const char* fstypes)
+{
+    fstype_policy_t value;
+    uint32_t count = 0;
+
+    if (!strcasecmp(policy, "include"))
+        value = FSTYPE_INCLUDE;
+    else if (!strcasecmp(policy, "targeted"))
+        value = FSTYPE_TARGETED;
+    else if (!strcasecmp(policy, "exclude"))
+        value = FSTYPE_EXCLUDE;
+    else {
+        printf("WARNING: Unknown fstype policy '%s'\n", policy);
+        return 0;
+    }
+
+    for (const char* type = fstypes; *type;) {
+        size_t len = strcspn(type, ", \t\r\n");
+
+        if (len) {
+            fstype_policies[std::string(type, len)] = value;
+            count++;
+        }
+        type += len;
+        type += strspn(type, ", \t\r\n");
+    }
+
+    return count;
+}
+
+// Add overlayfs lowerdir, upperdir and workdir paths from mount options to dirs
+static void get_overlay_layer_dirs(const mount_info_t& mount, std::vector<std::string>& dirs)
+{
+    for (size_t pos = 0, end; pos < mount.super_options.size(); pos = end + 1) {
+        end = mount.super_options.find(',', pos);
+        if (end == std::string::npos)
+            end = mount.super_options.size();
+
+        std::string option = mount.super_options.substr(pos, end - pos);
+        size_t eq = option.find('=');
+
+        if ((eq == std::string::npos) || (option.compare(0, eq, "lowerdir") && option.compare(0, eq, "upperdir") && option.compare(0, eq, "workdir")))
+            continue;
+
+        // lowerdir is a colon separated list of layers
+        for (size_t dir = eq + 1, dir_end; dir < option.size(); dir = dir_end + 1) {
+            dir_end = option.find(':', dir);
+            if (dir_end == std::string::npos)
+                dir_end = option.size();
+
+            std::string path = mountinfo_unescape(option.substr(dir, dir_end - dir).c_str());
+
+            if ((path.size() > 1) && (path[0] == '/'))
+                dirs.push_back(path[path.size() - 1] == '/' ? path : path + "/");
+        }
+    }
+}
+
+bool thread_info_t::check_new_mount(dirqueue_entry_t* entry, scan_mount_t& mount)
+{
+    uint64_t ino = 0;
+    int mnt_id = 0;
+    std::string path = get_dirqueue_entry_path(entry);
+
+    // Some filesystems (ie overlayfs) report different "." inodes: statx tells us for sure
+    if (!stat_get_mnt_id(AT_FDCWD, path.c_str(), ino, mnt_id) || (mnt_id == mount.mnt_id))
+        return true;
+
+    const mount_index_t* mount_index = tdata.refresh_mount_index(mnt_id);
+    auto it = mount_index->mount_points.find(path);
+
+    if ((it == mount_index->mount_points.end()) || (it->second.mnt_id != mnt_id))
+        return true;
+
+    if (g_verbose > 1) {
+        printf("Found new mount '%s'\n", path.c_str());
+    }
+
+    if (it->second.skip)
+        return false;
+
+    mount = it->second;
+    entry->dev = mount.dev;
+    entry->mnt_id = mount.mnt_id;
+    entry->mount_trie = mount_index->find_trie(path);
+
+    add_filename(ino, mount.dev, entry, "", false);
+    return true;
+}
+
+bool getdents_buffer_t::reserve(size_t new_size)
+{
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+
+    new_size = std::min(new_size, g_getdents_buffer_max);
+    new_size = (new_size + page_size - 1) & ~(page_size - 1);
+
+    if (new_size > size) {
+        void* new_buf = nullptr;
+
+        if (!posix_memalign(&new_buf, page_size, new_size)) {
+            // Smallest dirent is 24 bytes. Pad to a multiple of 8 for inode_filter_t.
+            size_t max_dirents = (new_size / 24 + 8) & ~(size_t)7;
+
+            free(buf);
+            buf = (char*)new_buf;
+            size = new_size;
+            keys.resize(max_dirents);
+            maybe.resize(max_dirents / 8);
+        }
+    }
+
+    return !!buf;
+}
+
+// Returns -1: queue empty, 0: open error, > 0 success
+int thread_info_t::parse_dirqueue_entry()
+{
+    if (!getdents_buf.reserve(getdents_buffer_t::INITIAL_SIZE)) {
+        printf("ERROR: Failed to allocate getdents64 buffer\n");
+        return -1;
+    }
+
+    dirqueue_entry_t* entry = dequeue_directory();
+    if (!entry)
+        entry = wait_for_directory();
+    if (!entry) {
+        return -1;
+    }
+
+    return parse_directory(entry);
+}
+
+int thread_info_t::parse_directory(dirqueue_entry_t* entry)
+{
+    if (entry->is_netfs && g_netfs_timeout) {
+        scan_netfs_directory(entry);
+        finish_directory(entry);
+        return 1;
+    }
+
+    int fd = open_directory(entry);
+    if (fd < 0) {
+        finish_directory(entry);
+        return 0;
+    }
+
+    if (!scan_directory(entry, fd))
+        close(fd);
+
+    finish_directory(entry);
+    return 1;
+}
+
+#if HAVE_IO_URING
+int thread_info_t::parse_dirqueue_batch()
+{
+    if (!getdents_buf.reserve(getdents_buffer_t::INITIAL_SIZE)) {
+        printf("ERROR: Failed to allocate getdents64 buffer\n");
+        return -1;
+    }
+
+    dirqueue_entry_t* entry = dequeue_directory();
+    if (!entry) {
+        // Don't hold on to fds while we're parked
+        flush_closes();
+        entry = wait_for_directory();
+    }
+    if (!entry) {
+        return -1;
+    }
+
+    // flush_closes() failed
+    if (!ring.is_open())
+        return parse_directory(entry);
+
+    // Take one directory from anywhere, then fill the batch from our own queue
+    dirqueue_entry_t* batch[io_uring_t::BATCH];
+    std::string relpaths[io_uring_t::BATCH];
+    unsigned count = 0;
+
+    for (; entry; entry = (count < tdata.io_uring_batch) ? dequeue_directory(false) : nullptr) {
+        if (entry->is_netfs && g_netfs_timeout) {
+            scan_netfs_directory(entry);
+            finish_directory(entry);
+            continue;
+        }
+
+        const char* path;
+        int dirfd = get_open_path(entry, relpaths[count], path);
+
+        if (is_automount_point(entry, dirfd, path)) {
+            finish_directory(entry);
+            continue;
+        }
+
+        ring.prep_openat(dirfd, path, DIR_OPEN_FLAGS, count);
+        batch[count++] = entry;
+    }
+
+    // Submit opens along with closes from the last batch, and wait for the opens
+    int fds[io_uring_t::BATCH];
+    unsigned opens_pending = count;
+
+    std::fill(fds, fds + count, -1);
+    bool ok = ring.submit_and_wait(count);
+
+    while (ok && (opens_pending || ring.pending_closes)) {
+        struct io_uring_cqe* cqe = ring.peek_cqe();
+
+        if (!cqe) {
+            if (!opens_pending)
+                break;
+            ok = ring.submit_and_wait(1);
+            continue;
+        }
+
+        if (cqe->user_data == io_uring_t::CLOSE_TAG) {
+            ring.pending_closes--;
+        } else {
+            fds[cqe->user_data] = cqe->res;
+            opens_pending--;
+        }
+        ring.cqe_seen();
+    }
+
+    if (!ok) {
+        // Close what the kernel did open (now or before the failure) and don't use the ring again
+        for (struct io_uring_cqe* cqe; (cqe = ring.peek_cqe()); ring.cqe_seen()) {
+            if ((cqe->user_data != io_uring_t::CLOSE_TAG) && (cqe->res >= 0))
+                close(cqe->res);
+        }
+        for (unsigned i = 0; i < count; i++) {
+            if (fds[i] >= 0)
+                close(fds[i]);
+        }
+
+        abandon_ring();
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        // If the ring failed, fall back to opening synchronously
+        int fd = ok ? fds[i] : open_directory(batch[i]);
+
+        if ((fd >= 0) && !scan_directory(batch[i], fd)) {
+            if (ok)
+                ring.prep_close(fd);
+            else
+                close(fd);
+        }
+
+        finish_directory(batch[i]);
+    }
+
+    return count;
+}
+
+void thread_info_t::flush_closes()
+{
+    if (!ring.pending_closes)
+        return;
+
+    bool ok = ring.submit_and_wait(ring.pending_closes);
+
+    while (ok && ring.pending_closes) {
+        struct io_uring_cqe* cqe = ring.peek_cqe();
+
+        if (!cqe) {
+            ok = ring.submit_and_wait(1);
+            continue;
+        }
+
+        ring.pending_closes--;
+        ring.cqe_seen();
+    }
+
+    if (!ok)
+        abandon_ring();
+}
+
+void thread_info_t::abandon_ring()
+{
+    std::vector<int> unsubmitted_closes;
+
+    printf("WARNING: io_uring failed, continuing without it\n");
+
+    // Closes the kernel never saw are still ours to do. Requests it's still working
+    // on are cancelled when the ring goes away.
+    ring.abandon(unsubmitted_closes);
+    for (int fd : unsubmitted_closes)
+        close(fd);
+}
+#endif // HAVE_IO_URING
+
+void thread_info_t::scan_netfs_directory(dirqueue_entry_t* entry)
+{
+    if (tdata.is_netfs_stale(entry->mnt_id)) {
+        tdata.netfs_skipped++;
+        return;
+    }
+
+    if (!netfs)
+        netfs = netfs_worker_t::create();
+    if (!netfs)
+        return;
+
+    std::string path = get_dirqueue_entry_path(entry);
+
+    if (!netfs->read_dir(path, getdents_buf.size, g_netfs_timeout)) {
+        if (g_verbose) {
+            printf("Timed out reading '%s' after %u seconds\n", path.c_str(), g_netfs_timeout);
+        }
+        netfs = nullptr;
+        tdata.set_netfs_timed_out(entry->mnt_id, path);
+        return;
+    }
+
+    if (netfs->automount && (g_verbose > 1)) {
+        printf("Skipping automount point '%s'\n", path.c_str());
+    }
+
+    // Open errors are skipped silently, like open_directory() failures
+    if (!netfs->err || !netfs->chunks.empty())
+        scan_directory(entry, -1, netfs);
+}
+
+bool thread_info_t::scan_directory(dirqueue_entry_t* entry, int fd, const netfs_worker_t* remote)
+{
+    scanned_dirs++;
+
+    // Mount roots on or below network filesystems are queued without an inode
+    // (stat could hang): pick it up now the directory has been opened.
+    if (!entry->ino) {
+        struct stat statbuf;
+
+        if (remote)
+            entry->ino = remote->ino;
+        else if (!fstat(fd, &statbuf))
+            entry->ino = statbuf.st_ino;
+
+        if (entry->ino && entry->parent)
+            add_filename(entry->ino, entry->dev, entry->parent, entry->name, true);
+        else if (entry->ino)
+            add_filename(entry->ino, entry->dev, entry, "", false);
+    }
+
+    // Keep our fd open so children can be opened relative to it
+    bool cache_fd = !remote && tdata.reserve_cached_fd();
+    if (cache_fd)
+        entry->fd = fd;
+
+    // Everything in this directory is on the same mount, unless it's a mount point
+    scan_mount_t mount;
+    mount.dev = entry->dev;
+    mount.mnt_id = entry->mnt_id;
+    mount.elevator = entry->elevator;
+    mount.group = entry->group;
+    mount.is_netfs = entry->is_netfs;
+    mount.is_btrfs = entry->is_btrfs;
+
+    bool first_read = true;
+    bool queued_dirs = false;
+    size_t dir_bytes = 0;
+    size_t netfs_chunk = 0;
+    size_t netfs_pos = 0;
+
+    for (;;) {
+        char* buf = getdents_buf.buf;
+        int ret;
+
+        if (remote) {
+            // Replay what the netfs worker read
+            if (netfs_chunk < remote->chunks.size()) {
+                buf = (char*)&remote->data[netfs_pos];
+                ret = remote->chunks[netfs_chunk++];
+                netfs_pos += ret;
+            } else {
+                ret = remote->err ? -1 : 0;
+                errno = remote->err;
+            }
+        } else {
+            ret = sys_getdents64(fd, buf, getdents_buf.size);
+        }
+
+        getdents_calls++;
+
+        if (ret < 0) {
+            bool spew_error = true;
+            std::string path = get_dirqueue_entry_path(entry);
+
+            if ((errno == 5) && !strncmp(path.c_str(), "/sys/kernel/", 12)) {
+                // In docker container we can get permission denied errors in /sys/kernel. Ignore them.
+                // https://github.com/mikesart/inotify-info/issues/16
+                spew_error = false;
+            }
+
+            if (spew_error) {
+                printf("ERROR: sys_getdents64 failed on '%s': %d errno: %d (%s)\n", path.c_str(), ret, errno, strerror(errno));
+            }
+            break;
+        }
+        if (ret == 0)
+            break;
+        if (tdata.all_inodes_found())
+            break;
+
+        if (first_read) {
+            struct linux_dirent64* dirp = (struct linux_dirent64*)buf;
+
+            // The "." entry inode differs from the parent's dirent inode: this is a mount root
+            // that wasn't in our mount index when the parent was scanned.
+            if (!remote && entry->ino && (dirp->d_ino != entry->ino) && !strcmp(dirp->d_name, ".")) {
+                if (!check_new_mount(entry, mount))
+                    break;
+            }
+
+            // btrfs subvolume roots are inode 256 (BTRFS_FIRST_FREE_OBJECTID). Snapshots of
+            // the subvolumes we're scanning would only give us the same files again.
+            if (mount.is_btrfs && !g_include_snapshots && entry->parent && (dirp->d_ino == 256) && !strcmp(dirp->d_name, ".") && is_btrfs_snapshot(fd)) {
+                if (g_verbose > 1) {
+                    printf("Skipping btrfs snapshot '%s'\n", get_dirqueue_entry_path(entry).c_str());
+                }
+                break;
+            }
+            first_read = false;
+        }
+
+        // Run all the inodes in this buffer through the prefilter: only possible
+        // matches need an exact (dev, inode) lookup in add_filename()
+        uint32_t* keys = getdents_buf.keys.data();
+        uint8_t* maybe = getdents_buf.maybe.data();
+        size_t count = 0;
+
+        for (int bpos = 0; bpos < ret; bpos += ((struct linux_dirent64*)(buf + bpos))->d_reclen)
+            keys[count++] = inode_filter_t::key(((struct linux_dirent64*)(buf + bpos))->d_ino);
+        for (size_t i = count; i & 7; i++)
+            keys[i] = 0;
+        tdata.inode_filter.filter(keys, count, maybe);
+
+        for (int bpos = 0, i = 0; bpos < ret; i++) {
+            struct linux_dirent64* dirp = (struct linux_dirent64*)(buf + bpos);
+            const char* d_name = dirp->d_name;
+            bool maybe_watched = (maybe[i / 8] >> (i % 8)) & 1;
+
+            // DT_BLK      This is a block device.
+            // DT_CHR      This is a character device.
+            // DT_FIFO     This is a named pipe (FIFO).
+            // DT_SOCK     This is a UNIX domain socket.
+            // DT_UNKNOWN  The file type could not be determined.
+
+            // DT_REG      This is a regular file.
+            // DT_LNK      This is a symbolic link.
+            if (dirp->d_type == DT_REG || dirp->d_type == DT_LNK) {
+                if (maybe_watched)
+                    add_filename(dirp->d_ino, mount.dev, entry, d_name, false);
+            }
+            // DT_DIR      This is a directory.
+            else if (dirp->d_type == DT_DIR) {
+                if (!g_include_snapshots && is_snapshot_dir(d_name)) {
+                    if (maybe_watched)
+                        add_filename(dirp->d_ino, mount.dev, entry, d_name, true);
+                    if (g_verbose > 1) {
+                        printf("Skipping snapshot dir '%s%s'\n", get_dirqueue_entry_path(entry).c_str(), d_name);
+                    }
+                } else if (!is_dot_dir(d_name)) {
+                    const mount_trie_t* mount_trie = nullptr;
+                    bool ignored;
+                    // Ignored subtrees are never queued
+                    const ignore_matcher_t::state_t* ignore_state = ignore_matcher.next(entry->ignore_state, d_name, ignored);
+
+                    if (ignored && (g_verbose > 1)) {
+                        printf("Ignoring '%s%s/'\n", get_dirqueue_entry_path(entry).c_str(), d_name);
+                    }
+
+                    // Only directories leading to mount points have a trie node
+                    if (entry->mount_trie) {
+                        auto it = entry->mount_trie->children.find(d_name);
+
+                        if (it != entry->mount_trie->children.end())
+                            mount_trie = it->second.get();
+                    }
+
+                    if (mount_trie && mount_trie->excluded) {
+                        if (maybe_watched)
+                            add_filename(dirp->d_ino, mount.dev, entry, d_name, true);
+                        if (!ignored) {
+                            dirqueue_entry_t* layer = new_dirqueue_entry(*arena, entry, d_name, dirp->d_ino, mount, mount_trie, ignore_state);
+
+                            if (g_verbose > 1) {
+                                printf("Deferring overlay layer '%s%s'\n", get_dirqueue_entry_path(entry).c_str(), d_name);
+                            }
+                            if (layer)
+                                tdata.defer_directory(layer);
+                        }
+                    } else if (!mount_trie || !mount_trie->mount) {
+                        if (maybe_watched)
+                            add_filename(dirp->d_ino, mount.dev, entry, d_name, true);
+                        if (!ignored) {
+                            queue_directory(entry, d_name, dirp->d_ino, mount, mount_trie, ignore_state);
+                            queued_dirs = true;
+                        }
+                    } else if (!mount_trie->mount->skip) {
+                        // Crossing into another mount. d_ino is the inode of the directory
+                        // underneath the mount point: we need the inode of the mount root.
+                        // Leave it to scan_directory() if stat could hang on a network mount.
+                        ino64_t ino = 0;
+
+                        if (!remote && !(mount_trie->mount->is_netfs && g_netfs_timeout)) {
+                            ino = stat_get_ino(fd, d_name);
+                            add_filename(ino, mount_trie->mount->dev, entry, d_name, true);
+                        }
+                        if (!ignored) {
+                            queue_directory(entry, d_name, ino, *mount_trie->mount, mount_trie, ignore_state);
+                            queued_dirs = true;
+                        }
+                    }
+                }
+            }
+
+            bpos += dirp->d_reclen;
+        }
+
+        // Mostly filled the buffer: this is a big directory, so read more entries per call
+        dir_bytes += ret;
+        if ((size_t)ret > getdents_buf.size / 2)
+            getdents_buf.reserve(getdents_buf.size * 2);
+    }
+
+    // Roughly how many calls this directory would have taken with a 1 KiB buffer
+    getdents_calls_1k += (dir_bytes + 1023) / 1024 + 1;
+
+    if (cache_fd && !queued_dirs) {
+        // Nobody needs our fd
+        entry->fd = -1;
+        tdata.fds_available++;
+    }
+
+    return entry->fd == fd;
+}
+
+static void* parse_dirqueue_threadproc(void* arg)
+{
+    thread_info_t* pthread_info = (thread_info_t*)arg;
+
+    bool done = false;
+
+#if HAVE_IO_URING
+    if (g_use_io_uring && pthread_info->ring.init()) {
+        // Carry on with the synchronous loop if the ring fails
+        while (!done && pthread_info->ring.is_open())
+            done = pthread_info->tdata.all_inodes_found() || (pthread_info->parse_dirqueue_batch() == -1);
+
+        if (pthread_info->ring.is_open())
+            pthread_info->flush_closes();
+    }
+#endif
+
+    // Loop until the scan is finished or everything has been found
+    while (!done)
+        done = pthread_info->tdata.all_inodes_found() || (pthread_info->parse_dirqueue_entry() == -1);
+
+    if (pthread_info->netfs)
+        pthread_info->netfs->quit();
+    return nullptr;
+}
+
+static bool watch_count_is_greater(const procinfo_t& elem1, const procinfo_t& elem2)
+{
+    // Threads find processes in any order: keep ties in pid order
+    if (elem1.watches != elem2.watches)
+        return elem1.watches > elem2.watches;
+    return elem1.pid < elem2.pid;
+}
+
+/*
+ * /proc/<pid> directories shared out to the proclist threads
+ */
+struct proclist_scan_t {
+    // Pids are handed out this many at a time
+    static const size_t BATCH = 64;
+
+    int proc_fd = -1;
+    const std::vector<std::string>* cmdline_applist = nullptr;
+    std::vector<pid_t> pids;
+    std::atomic<size_t> next_pid { 0 };
+};
+
+struct proclist_thread_t {
+    proclist_scan_t* scan = nullptr;
+    pthread_t pthread_id = 0;
+    // Processes with inotify instances found by this thread
+    std::vector<procinfo_t> found;
+};
+
+static void* init_inotify_proclist_threadproc(void* arg)
+{
+    proclist_thread_t* thread = (proclist_thread_t*)arg;
+    proclist_scan_t& scan = *thread->scan;
+
+    procfs_reader_t reader(scan.proc_fd);
+
+    for (;;) {
+        size_t start = scan.next_pid.fetch_add(proclist_scan_t::BATCH, std::memory_order_relaxed);
+        if (start >= scan.pids.size())
+            break;
+
+        size_t end = std::min(start + proclist_scan_t::BATCH, scan.pids.size());
+
+        for (size_t i = start; i < end; i++) {
+            procinfo_t procinfo;
+
+            procinfo.pid = scan.pids[i];
+            if (!reader.open_pid(procinfo.pid))
+                continue;
+
+            inotify_parse_fddir(reader, procinfo, *scan.cmdline_applist);
+            if (procinfo.instances)
+                thread->found.push_back(std::move(procinfo));
+        }
+    }
+    reader.close_pid();
+
+    return nullptr;
+}
+
+static bool init_inotify_proclist(std::vector<procinfo_t>& inotify_proclist, const std::vector<std::string>& cmdline_applist)
+{
+    proclist_scan_t scan;
 
-        if ((dname[1] == '.') && !dname[2])
-            return true;
+    scan.cmdline_applist = &cmdline_applist;
+    scan.proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (scan.proc_fd < 0) {
+        printf("ERROR: open /proc failed: %d (%s)\n", errno, strerror(errno));
+        return false;
     }
 
-    return false;
-}
+    std::unique_ptr<char[]> buf(new char[procfs_reader_t::DENTS_SIZE]);
 
-// From "linux/magic.h"
-#define PROC_SUPER_MAGIC 0x9fa0
-#define SMB_SUPER_MAGIC 0x517B
-#define CIFS_SUPER_MAGIC 0xFF534D42 /* the first four bytes of SMB PDUs */
-#define SMB2_SUPER_MAGIC 0xFE534D42
-#define FUSE_SUPER_MAGIC 0x65735546
+    for (;;) {
+        int ret = sys_getdents64(scan.proc_fd, buf.get(), procfs_reader_t::DENTS_SIZE);
+        if (ret <= 0)
+            break;
 
-// Detect proc and fuse directories and skip them.
-//   https://github.com/mikesart/inotify-info/issues/6
-// Could use setmntent("/proc/mounts", "r") + getmntent if speed is an issue?
-static bool is_proc_dir(const char* path, const char* d_name)
+        for (int bpos = 0; bpos < ret;) {
+            struct linux_dirent64* dirp = (struct linux_dirent64*)(buf.get() + bpos);
+
+            if ((dirp->d_type == DT_DIR) && isdigit(dirp->d_name[0]))
+                scan.pids.push_back(atoll(dirp->d_name));
+            bpos += dirp->d_reclen;
+        }
+    }
+
+    // Don't bother starting threads that wouldn't get a batch of pids
+    size_t numthreads = std::min<size_t>(g_numthreads, (scan.pids.size() + proclist_scan_t::BATCH - 1) / proclist_scan_t::BATCH);
+    std::vector<proclist_thread_t> threads(std::max<size_t>(numthreads, 1));
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].scan = &scan;
+
+        // Main thread is threads[0]
+        if (i && pthread_create(&threads[i].pthread_id, NULL, &init_inotify_proclist_threadproc, &threads[i])) {
+            printf("Warning: pthread_create failed. errno: %d\n", errno);
+            threads[i].pthread_id = 0;
+        }
+    }
+
+    init_inotify_proclist_threadproc(&threads[0]);
+
+    for (proclist_thread_t& thread : threads) {
+        if (thread.pthread_id)
+            pthread_join(thread.pthread_id, NULL);
+
+        for (procinfo_t& procinfo : thread.found) {
+            /* If any watches have been found, enable the stats display */
+            g_kernel_provides_watches_info |= !!procinfo.watches;
+
+            inotify_proclist.push_back(std::move(procinfo));
+        }
+    }
+    std::sort(inotify_proclist.begin(), inotify_proclist.end(), watch_count_is_greater);
+
+    close(scan.proc_fd);
+
+    return true;
+}
+
+// From:
+//  https://stackoverflow.com/questions/1449805/how-to-format-a-number-using-comma-as-thousands-separator-in-c
+size_t str_format_uint32(char dst[16], uint32_t num)
 {
-    struct statfs s;
-    std::string filename = std::string(path) + d_name;
+    if (thousands_sep) {
+        char src[16];
+        char* p_src = src;
+        char* p_dst = dst;
+        int num_len, commas;
 
-    if (statfs(filename.c_str(), &s) == 0) {
-        switch (s.f_type) {
-        case PROC_SUPER_MAGIC:
-        case FUSE_SUPER_MAGIC:
-            return true;
+        num_len = sprintf(src, "%u", num);
+
+        for (commas = 2 - num_len % 3; *p_src; commas = (commas + 1) % 3) {
+            *p_dst++ = *p_src++;
+            if (commas == 1) {
+                *p_dst++ = thousands_sep;
+            }
         }
+        *--p_dst = '\0';
+
+        return (size_t)(p_dst - dst);
     }
 
-    return false;
+    return sprintf(dst, "%u", num);
 }
 
-// Returns -1: queue empty, 0: open error, > 0 success
-int thread_info_t::parse_dirqueue_entry()
+static void print_inotify_proclist(std::vector<procinfo_t>& inotify_proclist)
 {
-    char __attribute__((aligned(16))) buf[1024];
+#if 0
+    // test data
+    procinfo_t proc_info = {};
+    proc_info.pid = 100;
+    proc_info.appname = "fsnotifier";
+    proc_info.watches = 2;
+    proc_info.instances = 1;
+    inotify_proclist.push_back(proc_info);
 
-    char* path = dequeue_directory();
-    if (!path) {
-        return -1;
+    proc_info.pid = 1000;
+    proc_info.appname = "evolution-addressbook-factor";
+    proc_info.watches = 116;
+    proc_info.instances = 10;
+    inotify_proclist.push_back(proc_info);
+
+    proc_info.pid = 22154;
+    proc_info.appname = "evolution-addressbook-factor blah blah";
+    proc_info.watches = 28200;
+    proc_info.instances = 100;
+    inotify_proclist.push_back(proc_info);
+
+    proc_info.pid = 0x7fffffff;
+    proc_info.appname = "evolution-addressbook-factor blah blah2";
+    proc_info.watches = 999999;
+    proc_info.instances = 999999999;
+    inotify_proclist.push_back(proc_info);
+#endif
+
+    int lenPid = 10;
+    int lenUid = 10;
+    int lenApp = 10;
+    int lenWatches = 8;
+    int lenInstances = 10;
+
+    for (procinfo_t& procinfo : inotify_proclist)
+        lenApp = std::max<int>(procinfo.appname.length(), lenApp);
+
+    /* If the number of watches is negative, the kernel doesn't support this info. omit the header*/
+    if (g_kernel_provides_watches_info)
+        printf("%s%*s %-*s %-*s %*s %*s%s\n",
+            BCYAN, lenPid, "Pid", lenUid, "Uid", lenApp, "App", lenWatches, "Watches", lenInstances, "Instances", RESET);
+    else
+        printf("%s%*s %-*s %*s %*s%s\n",
+            BCYAN, lenPid, "Pid", lenUid, "Uid", lenApp, "App", lenInstances, "Instances", RESET);
+
+    for (procinfo_t& procinfo : inotify_proclist) {
+        char watches_str[16];
+
+        str_format_uint32(watches_str, procinfo.watches);
+
+        if (g_kernel_provides_watches_info)
+            printf("%*d %-*d %s%-*s%s %*s %*u\n",
+                lenPid, procinfo.pid,
+                lenUid, procinfo.uid,
+                BYELLOW, lenApp, procinfo.appname.c_str(), RESET,
+                lenWatches, watches_str,
+                lenInstances, procinfo.instances);
+        else
+            printf("%*d %-*d %s%-*s%s %*u\n",
+                lenPid, procinfo.pid,
+                lenUid, procinfo.uid,
+                BYELLOW, lenApp, procinfo.appname.c_str(), RESET,
+                lenInstances, procinfo.instances);
+
+        if (g_verbose > 1) {
+            for (std::string& fname : procinfo.fdset_filenames) {
+                printf("    %s%s%s\n", CYAN, fname.c_str(), RESET);
+            }
+        }
+
+        if (procinfo.in_cmd_line) {
+            for (const auto& it1 : procinfo.dev_map) {
+                dev_t dev = it1.first;
+
+                printf("%s[%u.%u]:%s", BGRAY, major(dev), minor(dev), RESET);
+                for (const auto& it2 : it1.second) {
+                    std::string inode_device_str = string_format("%lu", it2);
+
+                    printf(" %s%s%s", BGRAY, inode_device_str.c_str(), RESET);
+                }
+                printf("\n");
+            }
+        }
     }
+}
 
-    for (std::string& dname : ignore_dirs) {
-        if (dname == path) {
-            if (g_verbose > 1) {
-                printf("Ignoring '%s'\n", path);
+bool thread_shared_data_t::init(uint32_t numthreads, const std::vector<procinfo_t>& inotify_proclist)
+{
+    for (const procinfo_t& procinfo : inotify_proclist) {
+        if (!procinfo.in_cmd_line)
+            continue;
+
+        for (const auto& it1 : procinfo.dev_map) {
+            dev_t dev = it1.first;
+
+            for (const auto& inode : it1.second) {
+                inode_table.insert(dev, inode);
             }
-            return 0;
         }
     }
 
-    int fd = open(path, O_RDONLY | O_DIRECTORY, 0);
-    if (fd < 0) {
-        free(path);
-        return 0;
+    inode_found.reset(new std::atomic<bool>[inode_table.capacity()]);
+    inode_resolved.reset(new bool[inode_table.capacity()]());
+    for (size_t i = 0; i < inode_table.capacity(); i++)
+        inode_found[i] = false;
+    inodes_remaining = inode_table.size();
+    inode_filter.build(inode_table);
+
+    if (inode_table.size()) {
+        numqueues = numthreads;
+        arenas.reset(new scan_arena_t[numthreads]);
+        if (g_use_lfqueue) {
+            dirqueues.resize(numthreads);
+            for (uint32_t i = 0; i < numthreads; i++)
+                dirqueues[i].init(&arenas[i]);
+        } else
+            ws_deques.reset(new ws_deque_t[numthreads]);
+
+        // Full scans want every path to these inodes, so don't resolve them by file handle
+        if (g_use_fhandles && !g_full_scan) {
+            std::unordered_map<dev_t, std::unordered_set<ino64_t>> fhandle_map;
+
+            for (const procinfo_t& procinfo : inotify_proclist) {
+                if (!procinfo.in_cmd_line)
+                    continue;
+
+                for (const fhandle_info_t& fhandle : procinfo.fhandles) {
+                    if (fhandle_map[fhandle.dev].insert(fhandle.inode).second)
+                        fhandles.push_back(fhandle);
+                }
+            }
+
+        }
+
+        mounts.load();
     }
 
-    scanned_dirs++;
+    return inode_table.size() != 0;
+}
+
+bool thread_shared_data_t::set_inode_found(size_t index)
+{
+    if (inode_found[index].exchange(true))
+        return false;
 
-    size_t pathlen = strlen(path);
+    inodes_remaining--;
+    return true;
+}
 
-    for (;;) {
-        int ret = sys_getdents64(fd, buf, sizeof(buf));
+const mount_trie_t* mount_index_t::find_trie(const std::string& path) const
+{
+    const mount_trie_t* node = &trie;
 
-        if (ret < 0) {
-            bool spew_error = true;
+    for (size_t pos = 1, end; node && ((end = path.find('/', pos)) != std::string::npos); pos = end + 1) {
+        auto it = node->children.find(path.substr(pos, end - pos));
 
-            if ((errno == 5) && !strncmp(path, "/sys/kernel/", 12)) {
-                // In docker container we can get permission denied errors in /sys/kernel. Ignore them.
-                // https://github.com/mikesart/inotify-info/issues/16
-                spew_error = false;
-            }
+        node = (it != node->children.end()) ? it->second.get() : nullptr;
+    }
 
-            if (spew_error) {
-                printf("ERROR: sys_getdents64 failed on '%s': %d errno: %d (%s)\n", path, ret, errno, strerror(errno));
+    return node;
+}
+
+// Add path (with trailing slash) to trie, returning its node
+static mount_trie_t* add_trie_path(mount_trie_t* node, const std::string& path)
+{
+    for (size_t pos = 1, end; (end = path.find('/', pos)) != std::string::npos; pos = end + 1) {
+        std::unique_ptr<mount_trie_t>& child = node->children[path.substr(pos, end - pos)];
+
+        if (!child)
+            child.reset(new mount_trie_t);
+        node = child.get();
+    }
+
+    return node;
+}
+
+// Returns true if root (mountinfo root field: no trailing slash) is or is inside dir
+static bool is_root_inside(const std::string& root, const std::string& dir)
+{
+    return (dir == "/") || (root == dir) || ((root.size() > dir.size()) && !root.compare(0, dir.size(), dir) && (root[dir.size()] == '/'));
+}
+
+// Returns true if everything visible in the alias mount at path can also be reached
+// at target through the mount at other_path
+static bool is_alias_complete(const std::map<std::string, const mount_info_t*>& visible,
+    const std::string& path, const std::string& other_path, const std::string& target)
+{
+    // Nothing else mounted over target
+    for (size_t pos = target.find('/', other_path.size()); pos != std::string::npos; pos = target.find('/', pos + 1)) {
+        if (visible.count(target.substr(0, pos + 1)))
+            return false;
+    }
+
+    // Mounts hiding parts of target must hide the same parts of the alias
+    for (auto it = visible.upper_bound(target); (it != visible.end()) && !it->first.compare(0, target.size(), target); ++it) {
+        if (!it->first.compare(0, path.size(), path))
+            continue;
+        if (!visible.count(path + it->first.substr(target.size())))
+            return false;
+    }
+
+    // And the scan doesn't skip it as a snapshot directory
+    if (!g_include_snapshots && is_snapshot_path(target.substr(other_path.size())))
+        return false;
+
+    // Or through --ignoredir
+    bool ignored;
+    ignore_matcher.path_state(target, ignored);
+
+    return !ignored;
+}
+
+// Find mounts of the same device whose root is inside another mount's root
+static void find_mount_aliases(const std::map<std::string, const mount_info_t*>& visible, mount_index_t* index)
+{
+    typedef std::pair<const std::string, const mount_info_t*> visible_mount_t;
+    std::unordered_map<dev_t, std::vector<const visible_mount_t*>> dev_mounts;
+
+    // File bind mounts can't hold other mounts' files
+    for (const visible_mount_t& it : visible) {
+        if (!index->mount_points[it.first].is_file)
+            dev_mounts[it.second->dev].push_back(&it);
+    }
+
+    // Prefer mounts of the biggest part of the filesystem, then the shortest path: the alias
+    // relation is then ordered and never has cycles.
+    auto is_preferred = [](const visible_mount_t& a, const visible_mount_t& b) {
+        if (a.second->root.size() != b.second->root.size())
+            return a.second->root.size() < b.second->root.size();
+        if (a.first.size() != b.first.size())
+            return a.first.size() < b.first.size();
+        return a.first < b.first;
+    };
+
+    for (const visible_mount_t& it : visible) {
+        const std::vector<const visible_mount_t*>& same_dev = dev_mounts[it.second->dev];
+        const visible_mount_t* best = nullptr;
+        std::string best_target;
+
+        if ((same_dev.size() < 2) || index->mount_points[it.first].is_file)
+            continue;
+
+        for (const visible_mount_t* other : same_dev) {
+            if (!is_preferred(*other, it) || !is_root_inside(it.second->root, other->second->root))
+                continue;
+            if (best && !is_preferred(*other, *best))
+                continue;
+
+            // Path of our root through the other mount
+            std::string target = other->first;
+            if (it.second->root != other->second->root)
+                target += it.second->root.substr(other->second->root.size() + (other->second->root == "/" ? 0 : 1)) + "/";
+
+            if (is_alias_complete(visible, it.first, other->first, target)) {
+                best = other;
+                best_target = target;
             }
-            break;
         }
-        if (ret == 0)
-            break;
 
-        for (int bpos = 0; bpos < ret;) {
-            struct linux_dirent64* dirp = (struct linux_dirent64*)(buf + bpos);
-            const char* d_name = dirp->d_name;
+        if (best) {
+            mount_alias_t alias;
 
-            // DT_BLK      This is a block device.
-            // DT_CHR      This is a character device.
-            // DT_FIFO     This is a named pipe (FIFO).
-            // DT_SOCK     This is a UNIX domain socket.
-            // DT_UNKNOWN  The file type could not be determined.
+            alias.dev = it.second->dev;
+            alias.path = it.first;
+            alias.target = best_target;
+            index->aliases.push_back(alias);
 
-            // DT_REG      This is a regular file.
-            // DT_LNK      This is a symbolic link.
-            if (dirp->d_type == DT_REG || dirp->d_type == DT_LNK) {
-                add_filename(dirp->d_ino, path, d_name, false);
+            scan_mount_t& scan_mount = index->mount_points[it.first];
+            if (!scan_mount.skip && !index->mount_points[best->first].skip) {
+                if (g_verbose > 1) {
+                    printf("Skipping mount '%s': same as '%s'\n", alias.path.c_str(), alias.target.c_str());
+                }
+                scan_mount.skip = true;
             }
-            // DT_DIR      This is a directory.
-            else if (dirp->d_type == DT_DIR) {
-                if (!is_dot_dir(d_name) && !is_proc_dir(path, d_name)) {
-                    add_filename(dirp->d_ino, path, d_name, true);
+        }
+    }
+}
+
+const mount_index_t* thread_shared_data_t::build_mount_index()
+{
+    mount_index_t* index = new mount_index_t;
+    // overlayfs mount -> its lower, upper and work dirs
+    std::map<const scan_mount_t*, std::vector<std::string>> overlay_layers;
+    // Mount point path -> visible mount
+    std::map<std::string, const mount_info_t*> visible;
+    // Mount at "/": with snapper its root can be a snapshot (/@/.snapshots/1/snapshot)
+    const mount_info_t* root_mount = nullptr;
+
+    for (const mount_info_t& mount : mounts.mounts) {
+        if (mount.mount_point == "/")
+            root_mount = &mount;
+    }
+
+    // Visible mount for each mount point path. Later mounts hide earlier ones.
+    for (const mount_info_t& mount : mounts.mounts) {
+        std::string path = mount.mount_point;
+
+        if (path.empty() || (path[path.size() - 1] != '/'))
+            path += "/";
+        visible[path] = &mount;
+
+        scan_mount_t& scan_mount = index->mount_points[path];
+
+        scan_mount.dev = mount.dev;
+        scan_mount.mnt_id = mount.mnt_id;
+        scan_mount.is_proc = is_proc_fstype(mount.fstype);
+        scan_mount.is_netfs = is_netfs_fstype(mount.fstype);
+        scan_mount.is_btrfs = (mount.fstype == "btrfs");
+        // autofs mount points mount whatever is looked up underneath them. Mounts
+        // of snapshots (snapper's .snapshots, ...) duplicate the filesystems they're of:
+        // those mounted under a snapshot directory, and snapshots of the root filesystem
+        // other than the one mounted at "/".
+        bool is_snapshot = is_snapshot_path(mount.mount_point) || (root_mount && (mount.dev == root_mount->dev) && !is_root_inside(mount.root, root_mount->root) && is_snapshot_path(mount.root));
+        scan_mount.is_excluded = (!g_include_automounts && (mount.fstype == "autofs")) || (!g_include_snapshots && is_snapshot);
+        scan_mount.policy = get_fstype_policy(mount.fstype);
+
+        overlay_layers.erase(&scan_mount);
+        if (mount.fstype == "overlay")
+            get_overlay_layer_dirs(mount, overlay_layers[&scan_mount]);
+
+        index->mnt_ids.insert(mount.mnt_id);
+    }
+
+    if (index->mount_points.empty()) {
+        // No mount table: assume everything is on the root device
+        index->mount_points["/"].dev = stat_get_dev_t("/");
+    }
+
+    for (auto& it : index->mount_points) {
+        struct stat statbuf;
+        bool is_targeted = target_devs.count(it.second.dev);
+        // Falling back to scanning everything still leaves out pseudo filesystems
+        bool scan_anyway = scan_all_mounts && (it.second.policy == FSTYPE_INCLUDE);
+        // Without the trailing slash: file bind mounts fail that with ENOTDIR
+        std::string path = (it.first.size() > 1) ? it.first.substr(0, it.first.size() - 1) : it.first;
+        bool never_scanned = it.second.is_proc || it.second.is_excluded || (it.second.policy == FSTYPE_EXCLUDE);
+
+        // Only stat mounts we may scan: a hung network or FUSE mount would block us here
+        if (!never_scanned && !it.second.is_netfs && !fstatat(AT_FDCWD, path.c_str(), &statbuf, AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW)) {
+            it.second.is_file = !S_ISDIR(statbuf.st_mode);
+
+            // st_dev can differ from the mountinfo device (ie btrfs subvolumes)
+            if (!is_targeted)
+                is_targeted = target_devs.count(statbuf.st_dev);
+        }
+
+        it.second.skip = !(is_targeted || scan_anyway) || never_scanned;
+        if (!it.second.skip) {
+            it.second.elevator = get_elevator(it.second.dev);
+            it.second.group = get_group(it.second.dev);
+        }
+
+        add_trie_path(&index->trie, it.first)->mount = &it.second;
+    }
+
+    find_mount_aliases(visible, index);
+
+    // Files in overlayfs layers are found through the overlay mount: only scan the layers
+    // if that leaves something unfound
+    for (const auto& it : overlay_layers) {
+        if (it.first->skip)
+            continue;
+
+        for (const std::string& path : it.second)
+            add_trie_path(&index->trie, path)->excluded = true;
+    }
+
+    mount_indexes.emplace_back(index);
+    mount_index.store(index, std::memory_order_release);
+    return index;
+}
+
+const mount_index_t* thread_shared_data_t::refresh_mount_index(int mnt_id)
+{
+    pthread_mutex_lock(&mount_index_lock);
+
+    const mount_index_t* index = get_mount_index();
+
+    // Another thread may have beaten us to it
+    if (!index->mnt_ids.count(mnt_id)) {
+        if (g_verbose > 1) {
+            printf("Reloading mountinfo for mount id %d\n", mnt_id);
+        }
+
+        mounts.load();
+        index = build_mount_index();
+    }
+
+    pthread_mutex_unlock(&mount_index_lock);
+    return index;
+}
 
-                    size_t len = strlen(d_name);
-                    char* newpath = (char*)malloc(pathlen + len + 2);
+// Returns true if block device dev is a spinning disk
+static bool is_rotational_dev(dev_t dev)
+{
+    // Anonymous devices (tmpfs, nfs, btrfs, overlayfs, ...) aren't block devices
+    if (!major(dev))
+        return false;
 
-                    if (newpath) {
-                        strcpy(newpath, path);
-                        strcpy(newpath + pathlen, d_name);
-                        newpath[pathlen + len] = '/';
-                        newpath[pathlen + len + 1] = 0;
+    char devpath[64];
+    snprintf(devpath, sizeof(devpath), "/sys/dev/block/%u:%u", major(dev), minor(dev));
 
-                        queue_directory(newpath);
-                    }
-                }
-            }
+    // Partitions don't have a queue directory: check the disk it's on
+    for (const char* subdir : { "/queue/rotational", "/../queue/rotational" }) {
+        std::string filename = std::string(devpath) + subdir;
+        char buf[8];
 
-            bpos += dirp->d_reclen;
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            ssize_t len = read(fd, buf, sizeof(buf));
+
+            close(fd);
+            return (len > 0) && (buf[0] == '1');
         }
     }
 
-    close(fd);
-    free(path);
-    return 1;
+    return false;
 }
 
-static void* parse_dirqueue_threadproc(void* arg)
+int thread_shared_data_t::get_elevator(dev_t dev)
 {
-    thread_info_t* pthread_info = (thread_info_t*)arg;
+    if (g_policy == POLICY_FIFO)
+        return -1;
 
-    for (;;) {
-        // Loop until all the dequeue(s) fail
-        if (pthread_info->parse_dirqueue_entry() == -1)
-            break;
+    auto it = elevator_devs.find(dev);
+    if (it != elevator_devs.end())
+        return it->second;
+
+    int index = -1;
+
+    if ((g_policy == POLICY_ELEVATOR) || is_rotational_dev(dev)) {
+        index = num_elevators.load();
+
+        if (index < MAX_ELEVATORS) {
+            elevators[index].reset(new elevator_t);
+            elevators[index]->dev = dev;
+            num_elevators.store(index + 1, std::memory_order_release);
+
+            if (g_verbose > 1) {
+                printf("Using elevator for device [%u:%u]\n", major(dev), minor(dev));
+            }
+        } else {
+            index = -1;
+        }
     }
 
-    return nullptr;
+    elevator_devs[dev] = index;
+    return index;
 }
 
-static bool is_proc_in_cmdline_applist(const procinfo_t& procinfo, std::vector<std::string>& cmdline_applist)
+int thread_shared_data_t::get_group(dev_t dev)
 {
-    for (const std::string& str : cmdline_applist) {
-        // Check if our command line string is a subset of this appname
-        if (strstr(procinfo.appname.c_str(), str.c_str()))
-            return true;
+    int count = num_groups.load();
 
-        // Check if the PIDs match
-        if (atoll(str.c_str()) == procinfo.pid)
-            return true;
+    if (!count) {
+        // Group 0: non-block devices
+        groups[0].reset(new worker_group_t);
+        num_groups.store(count = 1, std::memory_order_release);
+    }
+    if (!major(dev))
+        return 0;
+
+    for (int i = 1; i < count; i++) {
+        if (groups[i]->dev == dev)
+            return i;
     }
 
-    return false;
-}
+    // Out of groups: share the non-block group
+    if (count == MAX_GROUPS)
+        return 0;
 
-static bool watch_count_is_greater(procinfo_t elem1, procinfo_t elem2)
-{
-    return elem1.watches > elem2.watches;
+    groups[count].reset(new worker_group_t);
+    groups[count]->dev = dev;
+    groups[count]->use_elevator = (get_elevator(dev) >= 0);
+    num_groups.store(count + 1, std::memory_order_release);
+    return count;
 }
 
-static bool init_inotify_proclist(std::vector<procinfo_t>& inotify_proclist)
+std::vector<int> thread_shared_data_t::assign_worker_groups(uint32_t numthreads)
 {
-    DIR* dir_proc = opendir("/proc");
+    std::vector<int> thread_groups;
+    std::vector<int> fast_groups;
 
-    if (!dir_proc) {
-        printf("ERROR: opendir /proc failed: %d (%s)\n", errno, strerror(errno));
-        return false;
-    }
+    // Make sure the non-block group exists even if no mounts were indexed
+    pthread_mutex_lock(&mount_index_lock);
+    get_group(0);
+    pthread_mutex_unlock(&mount_index_lock);
 
-    for (;;) {
-        struct dirent* dp_proc = readdir(dir_proc);
-        if (!dp_proc)
-            break;
+    int count = num_groups.load();
 
-        if ((dp_proc->d_type == DT_DIR) && isdigit(dp_proc->d_name[0])) {
-            procinfo_t procinfo;
+    // Devices with an elevator get as many threads as it lets scan at once
+    for (int i = 0; i < count && thread_groups.size() < numthreads; i++) {
+        if (!groups[i]->use_elevator) {
+            fast_groups.push_back(i);
+            continue;
+        }
 
-            procinfo.pid = atoll(dp_proc->d_name);
+        for (uint32_t j = 0; j < elevator_t::MAX_ACTIVE && thread_groups.size() < numthreads; j++)
+            thread_groups.push_back(i);
+    }
 
-            std::string executable = string_format("/proc/%d/exe", procinfo.pid);
-            std::string status = string_format("/proc/%d/status", procinfo.pid);
-            procinfo.uid = get_uid(status.c_str());
-            procinfo.executable = get_link_name(executable.c_str());
-            if (!procinfo.executable.empty()) {
-                procinfo.appname = basename((char*)procinfo.executable.c_str());
+    // Split the rest evenly between the other groups
+    for (size_t i = 0; thread_groups.size() < numthreads; i++)
+        thread_groups.push_back(fast_groups.empty() ? (int)(i % count) : fast_groups[i % fast_groups.size()]);
 
-                inotify_parse_fddir(procinfo);
+    for (uint32_t idx = 0; idx < numthreads; idx++)
+        groups[thread_groups[idx]]->members.push_back(idx);
 
-                if (procinfo.instances) {
-                    inotify_proclist.push_back(procinfo);
-                }
-            }
+    if (g_verbose) {
+        for (int i = 0; i < count; i++) {
+            const worker_group_t& group = *groups[i];
+
+            if (group.dev)
+                printf("Device [%u:%u]%s: %zu threads\n", major(group.dev), minor(group.dev),
+                    group.use_elevator ? " (elevator)" : "", group.members.size());
+            else
+                printf("Non-block devices: %zu threads\n", group.members.size());
         }
     }
-    std::sort(inotify_proclist.begin(), inotify_proclist.end(), watch_count_is_greater);
 
-    closedir(dir_proc);
-    return true;
+    return thread_groups;
 }
 
-// From:
-//  https://stackoverflow.com/questions/1449805/how-to-format-a-number-using-comma-as-thousands-separator-in-c
-size_t str_format_uint32(char dst[16], uint32_t num)
+void thread_shared_data_t::push_inbox(dirqueue_entry_t* entry)
 {
-    if (thousands_sep) {
-        char src[16];
-        char* p_src = src;
-        char* p_dst = dst;
-        int num_len, commas;
+    worker_group_t& group = *groups[entry->group];
 
-        num_len = sprintf(src, "%u", num);
+    pthread_mutex_lock(&group.inbox_lock);
+    group.inbox.push_back(entry);
+    group.inbox_count++;
+    pthread_mutex_unlock(&group.inbox_lock);
+}
 
-        for (commas = 2 - num_len % 3; *p_src; commas = (commas + 1) % 3) {
-            *p_dst++ = *p_src++;
-            if (commas == 1) {
-                *p_dst++ = thousands_sep;
-            }
-        }
-        *--p_dst = '\0';
+dirqueue_entry_t* thread_shared_data_t::pop_inbox(int index)
+{
+    worker_group_t& group = *groups[index];
+    dirqueue_entry_t* entry = nullptr;
 
-        return (size_t)(p_dst - dst);
+    if (!group.inbox_count.load(std::memory_order_relaxed))
+        return nullptr;
+
+    pthread_mutex_lock(&group.inbox_lock);
+    if (!group.inbox.empty()) {
+        entry = group.inbox.back();
+        group.inbox.pop_back();
+        group.inbox_count--;
     }
+    pthread_mutex_unlock(&group.inbox_lock);
 
-    return sprintf(dst, "%u", num);
+    return entry;
 }
 
-static void print_inotify_proclist(std::vector<procinfo_t>& inotify_proclist)
+void thread_shared_data_t::init_scan_roots()
 {
-#if 0
-    // test data
-    procinfo_t proc_info = {};
-    proc_info.pid = 100;
-    proc_info.appname = "fsnotifier";
-    proc_info.watches = 2;
-    proc_info.instances = 1;
-    inotify_proclist.push_back(proc_info);
+    for (size_t i = 0; i < inode_table.capacity(); i++) {
+        if (inode_table.slot(i).inode && !inode_found[i])
+            target_devs.insert(inode_table.slot(i).dev);
+    }
 
-    proc_info.pid = 1000;
-    proc_info.appname = "evolution-addressbook-factor";
-    proc_info.watches = 116;
-    proc_info.instances = 10;
-    inotify_proclist.push_back(proc_info);
+    const mount_index_t* index = build_mount_index();
+    std::map<std::string, bool> targeted;
 
-    proc_info.pid = 22154;
-    proc_info.appname = "evolution-addressbook-factor blah blah";
-    proc_info.watches = 28200;
-    proc_info.instances = 100;
-    inotify_proclist.push_back(proc_info);
+    find_scan_roots(index, targeted);
 
-    proc_info.pid = 0x7fffffff;
-    proc_info.appname = "evolution-addressbook-factor blah blah2";
-    proc_info.watches = 999999;
-    proc_info.instances = 999999999;
-    inotify_proclist.push_back(proc_info);
-#endif
+    // No mount holds any of the devices we're looking for. Fall back to scanning everything
+    // (which the fstype policy allows).
+    if (scan_roots.empty() && scan_files.empty()) {
+        scan_all_mounts = true;
+        find_scan_roots(build_mount_index(), targeted);
+    }
 
-    int lenPid = 10;
-    int lenUid = 10;
-    int lenApp = 10;
-    int lenWatches = 8;
-    int lenInstances = 10;
+    if (g_verbose > 1) {
+        for (const std::string& path : scan_roots)
+            printf("Scanning mount '%s'\n", path.c_str());
+        for (const std::string& path : scan_files)
+            printf("Checking file mount '%s'\n", path.c_str());
+        for (const auto& it : targeted) {
+            if (!it.second)
+                printf("Skipping mount '%s'\n", it.first.c_str());
+        }
+    }
+}
 
-    for (procinfo_t& procinfo : inotify_proclist)
-        lenApp = std::max<int>(procinfo.appname.length(), lenApp);
+void thread_shared_data_t::find_scan_roots(const mount_index_t* index, std::map<std::string, bool>& targeted)
+{
+    // Mount point path -> is this mount being scanned?
+    targeted.clear();
+    scan_files.clear();
+    for (const auto& it : index->mount_points) {
+        targeted[it.first] = !it.second.skip;
+
+        // Directory scans don't cross into file mounts: they only see the file underneath
+        if (it.second.is_file && !it.second.skip)
+            scan_files.push_back(it.first);
+    }
 
-    /* If the number of watches is negative, the kernel doesn't support this info. omit the header*/
-    if (g_kernel_provides_watches_info)
-        printf("%s%*s %-*s %-*s %*s %*s%s\n",
-            BCYAN, lenPid, "Pid", lenUid, "Uid", lenApp, "App", lenWatches, "Watches", lenInstances, "Instances", RESET);
-    else
-        printf("%s%*s %-*s %*s %*s%s\n",
-            BCYAN, lenPid, "Pid", lenUid, "Uid", lenApp, "App", lenInstances, "Instances", RESET);
+    for (const auto& it : targeted) {
+        const std::string& path = it.first;
 
-    for (procinfo_t& procinfo : inotify_proclist) {
-        char watches_str[16];
+        if (!it.second || index->mount_points.find(path)->second.is_file)
+            continue;
 
-        str_format_uint32(watches_str, procinfo.watches);
+        // Find the closest mount above this one. If it's being scanned we'll get here from there.
+        bool parent_targeted = false;
 
-        if (g_kernel_provides_watches_info)
-            printf("%*d %-*d %s%-*s%s %*s %*u\n",
-                lenPid, procinfo.pid,
-                lenUid, procinfo.uid,
-                BYELLOW, lenApp, procinfo.appname.c_str(), RESET,
-                lenWatches, watches_str,
-                lenInstances, procinfo.instances);
-        else
-            printf("%*d %-*d %s%-*s%s %*u\n",
-                lenPid, procinfo.pid,
-                lenUid, procinfo.uid,
-                BYELLOW, lenApp, procinfo.appname.c_str(), RESET,
-                lenInstances, procinfo.instances);
+        for (size_t pos = path.rfind('/', path.size() - 2); (pos != std::string::npos) && (path.size() > 1); pos = path.rfind('/', pos - 1)) {
+            auto it_parent = targeted.find(path.substr(0, pos + 1));
 
-        if (g_verbose > 1) {
-            for (std::string& fname : procinfo.fdset_filenames) {
-                printf("    %s%s%s\n", CYAN, fname.c_str(), RESET);
+            if (it_parent != targeted.end()) {
+                parent_targeted = it_parent->second;
+                break;
             }
+            if (!pos)
+                break;
         }
 
-        if (procinfo.in_cmd_line) {
-            for (const auto& it1 : procinfo.dev_map) {
-                dev_t dev = it1.first;
+        if (!parent_targeted)
+            scan_roots.push_back(path);
+    }
+}
 
-                printf("%s[%u.%u]:%s", BGRAY, major(dev), minor(dev), RESET);
-                for (const auto& it2 : it1.second) {
-                    std::string inode_device_str = string_format("%lu", it2);
+// Open file handle and get filename. Returns 0 on success, errno on failure.
+static int fhandle_get_filename(mount_table_t& mount_table, const fhandle_info_t& fhandle, std::string& filename)
+{
+    char __attribute__((aligned(8))) buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+    struct file_handle* fh = (struct file_handle*)buf;
+    int err = ESTALE;
+
+    fh->handle_bytes = fhandle.handle.size();
+    fh->handle_type = fhandle.handle_type;
+    memcpy(fh->f_handle, fhandle.handle.data(), fhandle.handle.size());
+
+    // Try mounts of the whole filesystem first: bind mounts of subdirectories
+    // can't reach inodes outside their root and will fail verification.
+    for (int pass = 0; pass < 2; pass++) {
+        for (const mount_info_t& mount : mount_table.mounts) {
+            if ((mount.dev != fhandle.dev) || ((mount.root == "/") != (pass == 0)))
+                continue;
+            // Opening a hung network mount blocks forever: leave it to the scan
+            if (g_netfs_timeout && is_netfs_fstype(mount.fstype))
+                continue;
+
+            int mount_fd = mount_table.get_mount_fd(mount);
+            if (mount_fd < 0)
+                continue;
+
+            int fd = open_by_handle_at(mount_fd, fh, O_PATH | O_CLOEXEC);
+            if (fd < 0) {
+                // Requires CAP_DAC_READ_SEARCH
+                if (errno == EPERM)
+                    return EPERM;
+
+                err = errno;
+                // Stale for the whole filesystem: bind mounts of it won't do any better
+                if ((pass == 0) && ((err == ESTALE) || (err == ENOENT)))
+                    return err;
+                continue;
+            }
 
-                    printf(" %s%s%s", BGRAY, inode_device_str.c_str(), RESET);
-                }
-                printf("\n");
+            std::string linkname = get_link_name(string_format("/proc/self/fd/%d", fd).c_str());
+            struct stat fd_statbuf;
+            struct stat path_statbuf;
+
+            // Make sure the path we got back still refers to this inode. Disconnected
+            // dentries and deleted files give us paths which can't be looked up.
+            if (!linkname.empty() && (linkname[0] == '/') && !fstat(fd, &fd_statbuf) && !lstat(linkname.c_str(), &path_statbuf) && (fd_statbuf.st_dev == path_statbuf.st_dev) && (fd_statbuf.st_ino == path_statbuf.st_ino) && (fd_statbuf.st_ino == fhandle.inode)) {
+                filename = linkname;
+                if (S_ISDIR(fd_statbuf.st_mode) && (filename != "/"))
+                    filename += "/";
+
+                close(fd);
+                return 0;
             }
+
+            close(fd);
         }
     }
+
+    return err;
 }
 
-bool thread_shared_data_t::init(uint32_t numthreads, const std::vector<procinfo_t>& inotify_proclist)
+// Resolve inodes with open_by_handle_at() and mark them found
+static uint32_t find_files_by_fhandle(thread_shared_data_t& tdata, std::vector<filename_info_t>& all_found_files)
 {
-    for (const procinfo_t& procinfo : inotify_proclist) {
-        if (!procinfo.in_cmd_line)
+    uint32_t resolved = 0;
+
+    for (const fhandle_info_t& fhandle : tdata.fhandles) {
+        size_t index = tdata.inode_table.find(fhandle.dev, fhandle.inode);
+        if ((index == inode_table_t::NOT_FOUND) || tdata.inode_found[index])
             continue;
 
-        for (const auto& it1 : procinfo.dev_map) {
-            dev_t dev = it1.first;
+        filename_info_t fname;
 
-            for (const auto& inode : it1.second) {
-                inode_set[inode].insert(dev);
+        int err = fhandle_get_filename(tdata.mounts, fhandle, fname.filename);
+        if (err == EPERM) {
+            if (g_verbose) {
+                printf("open_by_handle_at failed (CAP_DAC_READ_SEARCH required), falling back to directory scan\n");
             }
+            break;
         }
-    }
+        if (err) {
+            if (g_verbose > 1) {
+                printf("open_by_handle_at( %lu [%u:%u] ) failed. Errno: %d (%s)\n",
+                    fhandle.inode, major(fhandle.dev), minor(fhandle.dev), err, strerror(err));
+            }
+            continue;
+        }
+
+        fname.inode = fhandle.inode;
+        fname.dev = fhandle.dev;
+        all_found_files.push_back(fname);
 
-    if (!inode_set.empty()) {
-        dirqueues.resize(numthreads);
+        tdata.set_inode_found(index);
+        tdata.inode_resolved[index] = true;
+        resolved++;
     }
 
-    return !inode_set.empty();
+    // Don't hold on to mount fds while the directory scan uses up our fd budget
+    tdata.mounts.close_mount_fds();
+    return resolved;
+}
+
+static void sort_found_files(std::vector<filename_info_t>& all_found_files)
+{
+    struct
+    {
+        bool operator()(const filename_info_t& a, const filename_info_t& b) const
+        {
+            if (a.dev == b.dev)
+                return a.inode < b.inode;
+            return a.dev < b.dev;
+        }
+    } filename_info_less_func;
+
+    std::sort(all_found_files.begin(), all_found_files.end(), filename_info_less_func);
+}
+
+// Fill in alt_filenames with paths to the same files through mount aliases
+static void add_alt_filenames(const std::vector<mount_alias_t>& aliases, std::vector<filename_info_t>& all_found_files)
+{
+    for (filename_info_t& fname : all_found_files) {
+        std::vector<std::string> paths(1, fname.filename);
+
+        // Aliases can be of other aliases (and file handles can give us alias paths): follow
+        // them both ways until we run out of new paths.
+        for (size_t i = 0; i < paths.size(); i++) {
+            for (const mount_alias_t& alias : aliases) {
+                std::string path;
+
+                if (alias.dev != fname.dev)
+                    continue;
+
+                if (!paths[i].compare(0, alias.path.size(), alias.path))
+                    path = alias.target + paths[i].substr(alias.path.size());
+                else if (!paths[i].compare(0, alias.target.size(), alias.target))
+                    path = alias.path + paths[i].substr(alias.target.size());
+                else
+                    continue;
+
+                if (std::find(paths.begin(), paths.end(), path) == paths.end())
+                    paths.push_back(path);
+            }
+        }
+
+        fname.alt_filenames.assign(paths.begin() + 1, paths.end());
+        std::sort(fname.alt_filenames.begin(), fname.alt_filenames.end());
+    }
 }
 
-static uint32_t find_files_in_inode_set(const std::vector<procinfo_t>& inotify_proclist,
-    std::vector<filename_info_t>& all_found_files)
+static bool find_files_in_inode_set(const std::vector<procinfo_t>& inotify_proclist,
+    std::vector<filename_info_t>& all_found_files, search_stats_t& stats)
 {
     thread_shared_data_t tdata;
 
     g_numthreads = std::max<size_t>(1, g_numthreads);
 
     if (!tdata.init(g_numthreads, inotify_proclist))
-        return 0;
+        return false;
+
+    stats.total_inodes = tdata.inode_table.size();
+
+    if (!tdata.fhandles.empty()) {
+        printf("\n%sResolving listed inodes by file handle...%s\n", BCYAN, RESET);
+
+        stats.fhandle_inodes = find_files_by_fhandle(tdata, all_found_files);
+
+        if (!tdata.inodes_remaining) {
+            add_alt_filenames(tdata.build_mount_index()->aliases, all_found_files);
+            sort_found_files(all_found_files);
+            return true;
+        }
+    }
+
+    if (g_use_io_uring) {
+#if HAVE_IO_URING
+        g_use_io_uring = io_uring_t::supported();
+#else
+        g_use_io_uring = false;
+#endif
+        if (!g_use_io_uring)
+            printf("WARNING: io_uring openat/close not available, using synchronous I/O\n");
+    }
 
-    printf("\n%sSearching '/' for listed inodes...%s (%lu threads)\n", BCYAN, RESET, g_numthreads);
+    tdata.init_scan_roots();
+    tdata.init_fd_cache();
+
+    printf("\n%sSearching '/' for listed inodes...%s (%lu threads%s)\n", BCYAN, RESET, g_numthreads, g_use_io_uring ? ", io_uring" : "");
 
     // Initialize thread_info_t array
     std::vector<class thread_info_t> thread_array(g_numthreads, thread_info_t(tdata));
+    std::vector<int> thread_groups = tdata.assign_worker_groups(thread_array.size());
+    std::vector<uint32_t> all_threads;
+
+    for (uint32_t idx = 0; idx < thread_array.size(); idx++)
+        all_threads.push_back(idx);
 
     for (uint32_t idx = 0; idx < thread_array.size(); idx++) {
         thread_info_t& thread_info = thread_array[idx];
 
         thread_info.idx = idx;
+        thread_info.rand_state = idx + 1;
+        thread_info.arena = &tdata.arenas[idx];
+        thread_info.group = thread_groups[idx];
+        thread_info.all_threads = all_threads;
 
         if (idx == 0) {
-            // Add root dir in case someone is watching it
-            thread_info.add_filename(stat_get_ino("/"), "/", "", false);
-            // Add and parse root
-            thread_info.queue_directory(strdup("/"));
+            const mount_index_t* mount_index = tdata.get_mount_index();
+
+            for (const std::string& path : tdata.scan_files) {
+                const scan_mount_t& mount = mount_index->mount_points.find(path)->second;
+                std::string filename = path.substr(0, path.size() - 1);
+
+                thread_info.add_filename(stat_get_ino(AT_FDCWD, filename.c_str()), mount.dev, filename);
+            }
+
+            for (const std::string& path : tdata.scan_roots) {
+                const scan_mount_t& mount = mount_index->mount_points.find(path)->second;
+                // Network mount roots get their inode when scanned: stat could hang
+                ino64_t ino = (mount.is_netfs && g_netfs_timeout) ? 0 : stat_get_ino(AT_FDCWD, path.c_str());
+                bool ignored;
+                const ignore_matcher_t::state_t* ignore_state = ignore_matcher.path_state(path, ignored);
+                dirqueue_entry_t* entry = new_dirqueue_entry(*thread_info.arena, nullptr, path.c_str(), ino, mount, mount_index->find_trie(path), ignore_state);
+
+                if (entry) {
+                    // Add mount root dirs in case someone is watching them
+                    if (ino)
+                        thread_info.add_filename(ino, mount.dev, entry, "", false);
+                    if (!ignored) {
+                        thread_info.push_directory(entry);
+                    } else {
+                        if (g_verbose > 1) {
+                            printf("Ignoring '%s'\n", path.c_str());
+                        }
+                        tdata.release_dirqueue_entry(entry, *thread_info.arena);
+                    }
+                }
+            }
+
+            // Parse first root
             thread_info.parse_dirqueue_entry();
         } else if (pthread_create(&thread_info.pthread_id, NULL, &parse_dirqueue_threadproc, &thread_info)) {
             printf("Warning: pthread_create failed. errno: %d\n", errno);
@@ -850,7 +4436,6 @@ static uint32_t find_files_in_inode_set(const std::vector<procinfo_t>& inotify_p
     // Put main thread to work
     parse_dirqueue_threadproc(&thread_array[0]);
 
-    uint32_t total_scanned_dirs = 0;
     for (const thread_info_t& thread_info : thread_array) {
         if (thread_info.pthread_id) {
             if (g_verbose > 1) {
@@ -866,30 +4451,45 @@ static uint32_t find_files_in_inode_set(const std::vector<procinfo_t>& inotify_p
         }
 
         // Snag data from this thread
-        total_scanned_dirs += thread_info.scanned_dirs;
+        stats.scanned_dirs += thread_info.scanned_dirs;
+        stats.getdents_calls += thread_info.getdents_calls;
+        stats.getdents_calls_1k += thread_info.getdents_calls_1k;
 
         all_found_files.insert(all_found_files.end(),
             thread_info.found_files.begin(), thread_info.found_files.end());
 
-        if (g_verbose > 1) {
-            printf("Thread #%zu: %u dirs, %zu files found\n",
-                thread_info.pthread_id, thread_info.scanned_dirs, thread_info.found_files.size());
+        if (g_verbose) {
+            printf("Thread #%u: %u dirs, %zu files found\n",
+                thread_info.idx, thread_info.scanned_dirs, thread_info.found_files.size());
         }
     }
 
-    struct
-    {
-        bool operator()(const filename_info_t& a, const filename_info_t& b) const
-        {
-            if (a.dev == b.dev)
-                return a.inode < b.inode;
-            return a.dev < b.dev;
-        }
-    } filename_info_less_func;
+    // Release directories left in the queues if we stopped early
+    for (thread_info_t& thread_info : thread_array) {
+        for (dirqueue_entry_t* entry; (entry = thread_info.dequeue_directory());)
+            tdata.release_dirqueue_entry(entry, *thread_info.arena);
+    }
+    for (dirqueue_entry_t* entry : tdata.deferred_dirs)
+        tdata.release_dirqueue_entry(entry, *thread_array[0].arena);
+
+    if (!tdata.netfs_timeouts.empty()) {
+        printf("WARNING: Network filesystem timed out after %u seconds, skipped %u directories under:\n",
+            g_netfs_timeout, (uint32_t)(tdata.netfs_timeouts.size() + tdata.netfs_skipped));
+        for (const std::string& path : tdata.netfs_timeouts)
+            printf("    %s\n", path.c_str());
+    }
 
-    std::sort(all_found_files.begin(), all_found_files.end(), filename_info_less_func);
+    for (uint32_t idx = 0; idx < tdata.numqueues; idx++) {
+        const scan_arena_t& arena = tdata.arenas[idx];
+
+        stats.arena_allocs += arena.allocs - arena.chunk_bytes / scan_arena_t::CHUNK_SIZE;
+        stats.arena_reused += arena.reused;
+        stats.arena_bytes += arena.chunk_bytes;
+    }
 
-    return total_scanned_dirs;
+    add_alt_filenames(tdata.get_mount_index()->aliases, all_found_files);
+    sort_found_files(all_found_files);
+    return true;
 }
 
 static uint32_t get_inotify_procfs_value(const std::string& fname)
@@ -929,6 +4529,7 @@ static void print_inotify_limits()
     }
 }
 
+// Returns number of ignore dirs and fstype policies read from config_file
 static uint32_t parse_config_file(const char* config_file)
 {
     uint32_t dir_count = 0;
@@ -937,6 +4538,7 @@ static uint32_t parse_config_file(const char* config_file)
     if (fp) {
         char line_buf[8192];
         bool in_ignore_dirs_section = false;
+        bool in_fstypes_section = false;
 
         for (;;) {
             if (!fgets(line_buf, sizeof(line_buf) - 1, fp))
@@ -944,15 +4546,20 @@ static uint32_t parse_config_file(const char* config_file)
 
             if (line_buf[0] == '#') {
                 // comment
-            } else if (!in_ignore_dirs_section) {
+            } else if (line_buf[0] == '[') {
                 size_t len = strcspn(line_buf, "\r\n");
 
-                if ((len == 12) && !strncmp("[ignoredirs]", line_buf, 12)) {
-                    in_ignore_dirs_section = true;
+                in_ignore_dirs_section = (len == 12) && !strncmp("[ignoredirs]", line_buf, 12);
+                in_fstypes_section = (len == 9) && !strncmp("[fstypes]", line_buf, 9);
+            } else if (in_fstypes_section) {
+                // "include|targeted|exclude fstype[,fstype...]"
+                size_t len = strcspn(line_buf, " \t\r\n");
+
+                if (len && line_buf[len] && (line_buf[len] != '\r') && (line_buf[len] != '\n')) {
+                    line_buf[len] = 0;
+                    dir_count += set_fstype_policy(line_buf, line_buf + len + 1);
                 }
-            } else if (line_buf[0] == '[') {
-                in_ignore_dirs_section = false;
-            } else if (in_ignore_dirs_section && (line_buf[0] == '/')) {
+            } else if (in_ignore_dirs_section && ((line_buf[0] == '/') || (line_buf[0] == '*'))) {
                 size_t len = strcspn(line_buf, "\r\n");
 
                 if (len > 1) {
@@ -1011,6 +4618,18 @@ static void print_version()
 static void print_usage(const char* appname)
 {
     printf("Usage: %s [--threads=##] [appname | pid...]\n", appname);
+    printf("    [--ignoredir=dir] (dir can be a glob, \"*/dir\" matches at any depth)\n");
+    printf("    [--no-fhandle]\n");
+    printf("    [--full-scan]\n");
+    printf("    [--queue=steal|lfqueue]\n");
+    printf("    [--io-uring]\n");
+    printf("    [--policy=auto|fifo|elevator]\n");
+    printf("    [--getdents-buffer=bytes[k|m]]\n");
+    printf("    [--netfs-timeout=seconds]\n");
+    printf("    [--include-automounts]\n");
+    printf("    [--include-snapshots]\n");
+    printf("    [--fstype=include|targeted|exclude:fstype[,fstype...]]\n");
+    printf("    [--no-color]\n");
     printf("    [-vv]\n");
     printf("    [--version]\n");
     printf("    [-?|-h|--help]\n");
@@ -1023,6 +4642,16 @@ static void parse_cmdline(int argc, char** argv, std::vector<std::string>& cmdli
         { "no-color", no_argument, 0, 0 },
         { "threads", required_argument, 0, 0 },
         { "ignoredir", required_argument, 0, 0 },
+        { "no-fhandle", no_argument, 0, 0 },
+        { "full-scan", no_argument, 0, 0 },
+        { "queue", required_argument, 0, 0 },
+        { "io-uring", no_argument, 0, 0 },
+        { "policy", required_argument, 0, 0 },
+        { "getdents-buffer", required_argument, 0, 0 },
+        { "netfs-timeout", required_argument, 0, 0 },
+        { "include-automounts", no_argument, 0, 0 },
+        { "include-snapshots", no_argument, 0, 0 },
+        { "fstype", required_argument, 0, 0 },
         { "version", no_argument, 0, 0 },
         { "help", no_argument, 0, 0 },
         { 0, 0, 0, 0 }
@@ -1031,6 +4660,9 @@ static void parse_cmdline(int argc, char** argv, std::vector<std::string>& cmdli
     // Let's pick the number of processors online (with a max of 32) for a default.
     g_numthreads = std::min<uint32_t>(g_numthreads, sysconf(_SC_NPROCESSORS_ONLN));
 
+    // --fstype policies override the config file, which is read last
+    std::vector<std::string> fstype_args;
+
     int c;
     int opt_ind = 0;
     while ((c = getopt_long(argc, argv, "m:s:?hv", long_opts, &opt_ind)) != -1) {
@@ -1050,6 +4682,40 @@ static void parse_cmdline(int argc, char** argv, std::vector<std::string>& cmdli
                 set_no_color();
             else if (!strcasecmp("threads", long_opts[opt_ind].name))
                 g_numthreads = atoi(optarg);
+            else if (!strcasecmp("no-fhandle", long_opts[opt_ind].name))
+                g_use_fhandles = false;
+            else if (!strcasecmp("full-scan", long_opts[opt_ind].name))
+                g_full_scan = true;
+            else if (!strcasecmp("queue", long_opts[opt_ind].name))
+                g_use_lfqueue = !strcasecmp(optarg, "lfqueue");
+            else if (!strcasecmp("io-uring", long_opts[opt_ind].name))
+                g_use_io_uring = true;
+            else if (!strcasecmp("policy", long_opts[opt_ind].name)) {
+                if (!strcasecmp(optarg, "fifo"))
+                    g_policy = POLICY_FIFO;
+                else if (!strcasecmp(optarg, "elevator"))
+                    g_policy = POLICY_ELEVATOR;
+                else
+                    g_policy = POLICY_AUTO;
+            }
+            else if (!strcasecmp("getdents-buffer", long_opts[opt_ind].name)) {
+                char* end = nullptr;
+                size_t size = strtoul(optarg, &end, 10);
+
+                if (*end == 'k' || *end == 'K')
+                    size *= 1024;
+                else if (*end == 'm' || *end == 'M')
+                    size *= 1024 * 1024;
+                g_getdents_buffer_max = std::max<size_t>(size, 4096);
+            }
+            else if (!strcasecmp("netfs-timeout", long_opts[opt_ind].name))
+                g_netfs_timeout = atoi(optarg);
+            else if (!strcasecmp("include-automounts", long_opts[opt_ind].name))
+                g_include_automounts = true;
+            else if (!strcasecmp("include-snapshots", long_opts[opt_ind].name))
+                g_include_snapshots = true;
+            else if (!strcasecmp("fstype", long_opts[opt_ind].name))
+                fstype_args.push_back(optarg);
             else if (!strcasecmp("ignoredir", long_opts[opt_ind].name)) {
                 std::string dirname = optarg;
                 if (dirname.size() > 1) {
@@ -1079,12 +4745,34 @@ static void parse_cmdline(int argc, char** argv, std::vector<std::string>& cmdli
 
     parse_ignore_dirs_file();
 
+    for (const std::string& dname : ignore_dirs)
+        ignore_matcher.add(dname);
+
+    for (std::string& arg : fstype_args) {
+        size_t colon = arg.find(':');
+
+        if (colon == std::string::npos) {
+            printf("WARNING: --fstype=%s missing policy\n", arg.c_str());
+            continue;
+        }
+        arg[colon] = 0;
+        set_fstype_policy(arg.c_str(), arg.c_str() + colon + 1);
+    }
+
     if (g_verbose > 1) {
+        static const char* policy_names[] = { "include", "targeted", "exclude" };
+
         printf("%lu ignore_dirs:\n", ignore_dirs.size());
 
         for (std::string& dname : ignore_dirs) {
             printf("  '%s'\n", dname.c_str());
         }
+
+        printf("%lu fstype policies:\n", fstype_policies.size());
+
+        for (const auto& it : fstype_policies) {
+            printf("  %s: %s\n", it.first.c_str(), policy_names[it.second]);
+        }
     }
 }
 
@@ -1109,14 +4797,12 @@ int main(int argc, char* argv[])
     print_inotify_limits();
     print_separator();
 
-    if (init_inotify_proclist(inotify_proclist)) {
+    if (init_inotify_proclist(inotify_proclist, cmdline_applist)) {
         uint32_t total_watches = 0;
         uint32_t total_instances = 0;
         std::vector<filename_info_t> all_found_files;
 
         for (procinfo_t& procinfo : inotify_proclist) {
-            procinfo.in_cmd_line = is_proc_in_cmdline_applist(procinfo, cmdline_applist);
-
             total_watches += procinfo.watches;
             total_instances += procinfo.instances;
         }
@@ -1131,20 +4817,42 @@ int main(int argc, char* argv[])
         printf("Total inotify Instances: %s%u%s\n", BGREEN, total_instances, RESET);
         print_separator();
 
+        search_stats_t stats;
         double search_time = gettime();
-        uint32_t total_scanned_dirs = find_files_in_inode_set(inotify_proclist, all_found_files);
-        if (total_scanned_dirs) {
+        if (find_files_in_inode_set(inotify_proclist, all_found_files, stats)) {
             search_time = gettime() - search_time;
 
             for (const filename_info_t& fname_info : all_found_files) {
                 printf("%s%9lu%s [%u:%u] %s\n", BGREEN, fname_info.inode, RESET,
                     major(fname_info.dev), minor(fname_info.dev),
                     fname_info.filename.c_str());
+
+                for (const std::string& filename : fname_info.alt_filenames) {
+                    printf("%9s [%u:%u] %s\n", "", major(fname_info.dev), minor(fname_info.dev), filename.c_str());
+                }
             }
 
             setlocale(LC_NUMERIC, "");
             GCC_DIAG_PUSH_OFF(format)
-            printf("\n%'u dirs scanned (%.2f seconds)\n", total_scanned_dirs, search_time);
+            printf("\n");
+            if (stats.fhandle_inodes)
+                printf("%'u of %'u inodes resolved by file handle\n", stats.fhandle_inodes, stats.total_inodes);
+            printf("%'u dirs scanned (%.2f seconds)\n", stats.scanned_dirs, search_time);
+            if (g_verbose && stats.getdents_calls) {
+                uint64_t saved = (stats.getdents_calls_1k > stats.getdents_calls) ? (stats.getdents_calls_1k - stats.getdents_calls) : 0;
+
+                printf("%'lu getdents64 calls (%'lu fewer than with 1 KiB buffers)\n", stats.getdents_calls, saved);
+            }
+            if (g_verbose) {
+                struct rusage usage;
+
+                if (stats.arena_allocs) {
+                    printf("%'lu queue allocations avoided (%'lu reused), %'zu KiB arena\n",
+                        stats.arena_allocs, stats.arena_reused, stats.arena_bytes / 1024);
+                }
+                if (!getrusage(RUSAGE_SELF, &usage))
+                    printf("Peak RSS: %'ld KiB\n", usage.ru_maxrss);
+            }
             GCC_DIAG_POP()
         }
     }